@@ -2,12 +2,19 @@
 #include "config.h"
 #include "control.h"
 #include "global.h"
+#include "history.h"
+#include "jobs.h"
+#include "keymap.h"
+#include "launch.h"
 
+#include <algorithm>
+#include <climits>
 #include <cstdlib>
 #include <cstring>
 #include <filesystem>
 #include <iostream>
 #include <string>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <vector>
 
@@ -21,10 +28,10 @@ bool file_exists(const string&);
 bool any_exists(const string&);
 
 namespace builtins {
-    int bexit(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
+    int bexit(int argc, char **argv, Effects *effects) {
         std::cout << "Goodbye!" << std::endl;
 
-        *flags |= FLAG_EXIT;
+        effects->flags |= FLAG_EXIT;
 
         if (argc < 2)
             return 0;
@@ -32,27 +39,27 @@ namespace builtins {
             return atoi(argv[1]);
     }
 
-    int bcd(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
+    int bcd(int argc, char **argv, Effects *effects) {
         if (argc < 2)
             return CODE_FAIL;
 
-        *flags |= FLAG_CD;
+        effects->flags |= FLAG_CD;
 
         string last_dir = std::filesystem::current_path();
 
         if (strcmp(argv[1], "-") == 0) {
             std::cout << prev_dir << std::endl;
-            strcpy(flag_arg_a, prev_dir.c_str());
+            effects->arg_a = prev_dir;
         } else {
-            strcpy(flag_arg_a, argv[1]);
+            effects->arg_a = argv[1];
         }
 
-        strcpy(flag_arg_b, last_dir.c_str());
+        effects->arg_b = last_dir;
 
         return CODE_CONTINUE;
     }
 
-    int babout(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
+    int babout(int argc, char **argv, Effects *effects) {
         std::cout << "WebShell (\e[38;5;166mw\e[38;5;167ms\e[38;5;168mh\e[m) ";
         std::cout << "v" << VERSION_MAJOR << "." << VERSION_MINOR << "." << VERSION_PATCH << std::endl;
         std::cout << "Created by Luke Donovan" << std::endl << std::endl;
@@ -65,56 +72,68 @@ namespace builtins {
         return CODE_CONTINUE;
     }
 
-    int band(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
+    int band(int argc, char **argv, Effects *effects) {
         if (last_status != 0)
-            *flags |= FLAG_SKIP;
+            effects->flags |= FLAG_SKIP;
 
         return last_status;
     }
 
-    int bor(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
+    int bor(int argc, char **argv, Effects *effects) {
         if (last_status == 0)
-            *flags |= FLAG_SKIP;
+            effects->flags |= FLAG_SKIP;
 
         return last_status;
     }
 
-    int bredirect(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
+    int bredirect(int argc, char **argv, Effects *effects) {
         return CODE_CONTINUE;
     }
 
-    int bsilence(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
+    int bsilence(int argc, char **argv, Effects *effects) {
         if (argc < 2)
             return CODE_FAIL;
 
-        *flags |= FLAG_SILENCE;
-        *flag_arg_a = strcmp(argv[1], "true") != 0;
+        effects->flags |= FLAG_SILENCE;
+        effects->arg_a = strcmp(argv[1], "true") != 0 ? "1" : "0";
 
         return CODE_CONTINUE;
     }
 
-    int bset(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
+    // With split true, an argument that's only a subcommand becomes an argument for
+    // each word of its output
+    int bsplit(int argc, char **argv, Effects *effects) {
+        if (argc < 2)
+            return CODE_FAIL;
+
+        effects->flags |= FLAG_SPLIT;
+        effects->arg_a = strcmp(argv[1], "true") == 0 ? "1" : "0";
+
+        return CODE_CONTINUE;
+    }
+
+    int bset(int argc, char **argv, Effects *effects) {
         if (argc < 3)
             return CODE_FAIL;
 
-        *flags |= FLAG_SET;
-        strcpy(flag_arg_a, argv[1]);
-        strcpy(flag_arg_b, argv[2]);
+        effects->flags |= FLAG_SET;
+        effects->arg_a = argv[1];
+        effects->arg_b = argv[2];
 
         return CODE_CONTINUE;
     }
 
-    int bunset(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
+    int bunset(int argc, char **argv, Effects *effects) {
         if (argc < 2)
             return CODE_FAIL;
 
-        *flags |= FLAG_UNSET;
-        strcpy(flag_arg_a, argv[1]);
+        effects->flags |= FLAG_UNSET;
+        effects->arg_a = argv[1];
 
         return CODE_CONTINUE;
     }
 
-    int bladd(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
+    int bladd(int argc, char **argv, Effects *effects) {
         if (argc < 3)
             return CODE_FAIL;
 
@@ -125,14 +144,14 @@ namespace builtins {
 
         result += var;
 
-        *flags |= FLAG_SET;
-        strcpy(flag_arg_a, argv[1]);
-        strcpy(flag_arg_b, result.c_str());
+        effects->flags |= FLAG_SET;
+        effects->arg_a = argv[1];
+        effects->arg_b = result;
 
         return CODE_CONTINUE;
     }
 
-    int bradd(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
+    int bradd(int argc, char **argv, Effects *effects) {
         if (argc < 3)
             return CODE_FAIL;
 
@@ -143,20 +162,20 @@ namespace builtins {
 
         var += result;
 
-        *flags |= FLAG_SET;
-        strcpy(flag_arg_a, argv[1]);
-        strcpy(flag_arg_b, var.c_str());
+        effects->flags |= FLAG_SET;
+        effects->arg_a = argv[1];
+        effects->arg_b = var;
 
         return CODE_CONTINUE;
     }
 
-    int breload(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
-        *flags |= FLAG_RELOAD;
+    int breload(int argc, char **argv, Effects *effects) {
+        effects->flags |= FLAG_RELOAD;
 
         return CODE_CONTINUE;
     }
 
-    int balias(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
+    int balias(int argc, char **argv, Effects *effects) {
         if (argc == 1) {
             std::cout << "Aliases:" << std::endl;
 
@@ -164,30 +183,32 @@ namespace builtins {
                 std::cout << "  " << it->first << " -> " << it->second << std::endl;
             }
         } else if (argc == 2) {
-            std::string name(argv[1]);
-            std::cout << alias_map[name] << std::endl;
+            // Builtins run inside the shell now, so operator[] would leave an empty alias behind
+            auto alias = alias_map.find(argv[1]);
+            if (alias != alias_map.end())
+                std::cout << alias->second << std::endl;
         } else {
-            *flags |= FLAG_ALIAS;
+            effects->flags |= FLAG_ALIAS;
 
-            strcpy(flag_arg_a, argv[1]);
-            strcpy(flag_arg_b, argv[2]);
+            effects->arg_a = argv[1];
+            effects->arg_b = argv[2];
         }
 
         return CODE_CONTINUE;
     }
 
-    int bunalias(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
+    int bunalias(int argc, char **argv, Effects *effects) {
         if (argc < 2)
             return CODE_FAIL;
 
-        *flags |= FLAG_ALIAS;
-        strcpy(flag_arg_a, argv[1]);
-        *flag_arg_b = '\0';
+        effects->flags |= FLAG_ALIAS;
+        effects->arg_a = argv[1];
+        effects->arg_b.clear();
 
         return CODE_CONTINUE;
     }
 
-    int bexists(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
+    int bexists(int argc, char **argv, Effects *effects) {
         if (argc < 3)
             return CODE_FAIL;
 
@@ -200,37 +221,40 @@ namespace builtins {
         return !any_exists(argv[1]);
     }
 
-    int bequals(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
+    int bequals(int argc, char **argv, Effects *effects) {
         if (argc < 3)
             return CODE_FAIL;
 
         return strcmp(argv[1], argv[2]) != 0;
     }
 
-    int bwith(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
+    int bwith(int argc, char **argv, Effects *effects) {
         if (argc < 3)
             return CODE_FAIL;
 
         const char* c_var = std::getenv(argv[1]);
 
         if (c_var == nullptr)
-            *flags |= FLAG_WITH_U;
+            effects->flags |= FLAG_WITH_U;
         else
-            *flags |= FLAG_WITH_S;
+            effects->flags |= FLAG_WITH_S;
 
-        strcpy(flag_arg_a, argv[1]);
-        strcpy(flag_arg_b, argv[2]);
+        effects->arg_a = argv[1];
+        effects->arg_b = argv[2];
 
         return CODE_CONTINUE;
     }
 
-    int bwithout(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
-        *flags |= FLAG_WITHOUT;
+    int bwithout(int argc, char **argv, Effects *effects) {
+        effects->flags |= FLAG_WITHOUT;
 
         return CODE_CONTINUE;
     }
 
-    int bwhich(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
+    int bwhich(int argc, char **argv, Effects *effects) {
+        if (argc < 2)
+            return CODE_FAIL;
+
         string cmd(argv[1]);
 
         auto alias = alias_map.find(cmd);
@@ -256,75 +280,223 @@ namespace builtins {
         return CODE_CONTINUE;
     }
 
-    int bdebug(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
-        *flags = atoi(argv[1]);
-        strcpy(flag_arg_a, argv[2]);
-        strcpy(flag_arg_b, argv[3]);
+    int bdebug(int argc, char **argv, Effects *effects) {
+        if (argc < 5)
+            return CODE_FAIL;
+
+        effects->flags = atoi(argv[1]);
+        effects->arg_a = argv[2];
+        effects->arg_b = argv[3];
 
         return atoi(argv[4]);
     }
 
-    int bfg(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
-        *flags |= FLAG_RESUME;
+    int bfg(int argc, char **argv, Effects *effects) {
+        const Job *job = find_job(argc > 1 ? argv[1] : "");
+
+        if (!job) {
+            std::cerr << "No such job!" << std::endl;
+            return CODE_FAIL;
+        }
+
+        effects->flags |= FLAG_RESUME;
+        effects->arg_a = std::to_string(job->id);
 
         return CODE_CONTINUE;
     }
 
-    int bkill(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
-        if (argc < 2)
+    int bbg(int argc, char **argv, Effects *effects) {
+        const Job *job = find_job(argc > 1 ? argv[1] : "");
+
+        if (!job) {
+            std::cerr << "No such job!" << std::endl;
             return CODE_FAIL;
+        }
+
+        effects->flags |= FLAG_BG;
+        effects->arg_a = std::to_string(job->id);
+
+        return CODE_CONTINUE;
+    }
+
+    int bjobs(int argc, char **argv, Effects *effects) {
+        for (const Job &job : job_list()) {
+            bool done = std::all_of(job.pids.begin(), job.pids.end(), [](pid_t pid) { return pid == -1; });
+            const char *state = done ? "Done" : job.stopped ? "Stopped" : "Running";
 
-        pid_t pid;
+            std::cout << "[" << job.id << "] " << state << " " << job.command << std::endl;
+        }
 
-        int idx = -1;
+        return CODE_CONTINUE;
+    }
 
-        if (strlen(argv[1]) > 1 && argv[1][0] == '%') {
-            idx = atoi(argv[1] + 1);
-            pid = suspended_pids[idx];
+    int bwait(int argc, char **argv, Effects *effects) {
+        // With no job given, waits for all of them
+        effects->flags |= FLAG_WAIT;
+        effects->arg_a = "0";
 
-            if (pid == -1) {
+        if (argc > 1) {
+            const Job *job = find_job(argv[1]);
+
+            if (!job) {
+                std::cerr << "No such job!" << std::endl;
+                return CODE_FAIL;
+            }
+
+            effects->arg_a = std::to_string(job->id);
+        }
+
+        return CODE_CONTINUE;
+    }
+
+    int bkill(int argc, char **argv, Effects *effects) {
+        if (argc < 2)
+            return CODE_FAIL;
+
+        if (argv[1][0] == '%') {
+            const Job *job = find_job(argv[1]);
+
+            if (!job) {
                 std::cerr << "Job is not running!" << std::endl;
                 return CODE_FAIL;
-            } else {
-                std::cout << "\e[1m" << "Killed PID " << pid << "\e[m" << std::endl;
             }
+
+            std::cout << "\e[1m" << "Killed [" << job->id << "] " << job->command << "\e[m" << std::endl;
         } else {
-            pid = atoi(argv[1]);
-            std::cout << "\e[1m" << "Killed PID " << pid << "\e[m" << std::endl;
+            std::cout << "\e[1m" << "Killed PID " << atoi(argv[1]) << "\e[m" << std::endl;
         }
 
-        *flags |= FLAG_KILL;
-        snprintf(flag_arg_a, sizeof(flag_arg_a), "%d", pid);
-        snprintf(flag_arg_b, sizeof(flag_arg_b), "%d", idx);
+        effects->flags |= FLAG_KILL;
+        effects->arg_a = argv[1];
 
         return CODE_CONTINUE;
     }
 
-    int brun(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
+    int brun(int argc, char **argv, Effects *effects) {
         if (argc < 2)
             return CODE_FAIL;
 
-        *flags |= FLAG_RUN;
-        strcpy(flag_arg_a, argv[1]);
+        effects->flags |= FLAG_RUN;
+        effects->arg_a = argv[1];
 
         return CODE_CONTINUE;
     }
 
-    int bsource(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
+    int bsource(int argc, char **argv, Effects *effects) {
         if (argc < 2)
             return CODE_FAIL;
 
-        *flags |= FLAG_SOURCE;
-        strcpy(flag_arg_a, argv[1]);
+        effects->flags |= FLAG_SOURCE;
+        effects->arg_a = argv[1];
+
+        return CODE_CONTINUE;
+    }
+
+    int bhistory(int argc, char **argv, Effects *effects) {
+        for (size_t idx = history_size(); idx > 0; --idx)
+            std::cout << history_at(idx - 1) << '\n';
+
+        std::cout << std::flush;
 
         return CODE_CONTINUE;
     }
 
-    int bhistory(int argc, char **argv, unsigned int *flags, char *flag_arg_a, char *flag_arg_b) {
-        for (auto it = history.rbegin(); it != history.rend(); ++it) {
-            std::cout << *it << std::endl;
+    int bbind(int argc, char **argv, Effects *effects) {
+        if (argc == 1) {
+            std::cout << "Key bindings:" << std::endl;
+
+            for (const auto &[key, action] : list_bindings())
+                std::cout << "  " << key << " -> " << action << std::endl;
+
+            return CODE_CONTINUE;
         }
 
+        std::vector<string> seqs;
+        Action action;
+
+        if (!parse_key(argv[1], &seqs)) {
+            std::cerr << "Unknown key: " << argv[1] << std::endl;
+            return CODE_FAIL;
+        }
+
+        if (argc == 2) {
+            std::cout << action_name(lookup_key(seqs[0])) << std::endl;
+            return CODE_CONTINUE;
+        }
+
+        if (!parse_action(argv[2], &action)) {
+            std::cerr << "Unknown action: " << argv[2] << std::endl;
+            return CODE_FAIL;
+        }
+
+        effects->flags |= FLAG_BIND;
+        effects->arg_a = argv[1];
+        effects->arg_b = argv[2];
+
         return CODE_CONTINUE;
     }
+
+    // Prints the exit status of each stage of the last pipeline, leaving last_status be
+    int bstatus(int argc, char **argv, Effects *effects) {
+        for (size_t i = 0; i < pipeline_status.size(); ++i)
+            std::cout << (i > 0 ? " " : "") << pipeline_status[i];
+
+        std::cout << std::endl;
+
+        return last_status;
+    }
+
+    // Runs a command, killing it if it's still going after a number of seconds, or of
+    // milliseconds, minutes or hours with an ms, m or h after it (s for seconds is
+    // allowed too), with 0 for no limit. Exits with 124 if it ran out of time.
+    int btimeout(int argc, char **argv, Effects *effects) {
+        if (argc < 3)
+            return CODE_FAIL;
+
+        char *unit;
+        double duration = strtod(argv[1], &unit);
+        double scale = 0;
+
+        if (strcmp(unit, "") == 0 || strcmp(unit, "s") == 0)
+            scale = 1000;
+        else if (strcmp(unit, "ms") == 0)
+            scale = 1;
+        else if (strcmp(unit, "m") == 0)
+            scale = 60 * 1000;
+        else if (strcmp(unit, "h") == 0)
+            scale = 60 * 60 * 1000;
+
+        if (unit == argv[1] || scale == 0 || !(duration >= 0) || duration * scale > INT_MAX) {
+            std::cerr << "Invalid duration! Give a number with ms, s, m or h after it, or none for seconds" << std::endl;
+            return CODE_FAIL;
+        }
+
+        if (builtins_map.count(argv[2])) {
+            std::cerr << "Builtins can't be timed!" << std::endl;
+            return CODE_FAIL;
+        }
+
+        auto executable = executable_map.find(argv[2]);
+        string path = executable != executable_map.end() ? executable->second : argv[2];
+        char *command = argv[2];
+        int status;
+
+        // It gets a process group of its own, so that everything it starts is killed too
+        argv[2] = path.data();
+        std::cout.flush();
+        pid_t pid = launch_command(argv + 2, -1, -1, {}, 0);
+        argv[2] = command;
+
+        if (pid < 0) {
+            perror(command);
+            return CODE_FAIL;
+        }
+
+        setpgid(pid, pid);
+
+        if (!wait_timed(pid, &status, duration == 0 ? -1 : std::max(1, (int) (duration * scale))))
+            return 124;
+
+        return exit_code(status);
+    }
 }
@@ -1,31 +1,50 @@
 #pragma once
 
+#include <string>
+
+// Side effects a builtin asks the shell to apply once it returns. These
+// are carried back over a pipe when the builtin had to run in a child.
+struct Effects {
+    unsigned int flags = 0;
+    std::string arg_a;
+    std::string arg_b;
+};
+
+using builtin_fn = int (*)(int, char**, Effects*);
+
 namespace builtins {
-    int bexit(int, char**, unsigned int*, char*, char*);
-    int bcd(int, char**, unsigned int*, char*, char*);
-    int babout(int, char**, unsigned int*, char*, char*);
-    int band(int, char**, unsigned int*, char*, char*);
-    int bor(int, char**, unsigned int*, char*, char*);
-    int bredirect(int, char**, unsigned int*, char*, char*);
-    int bsilence(int, char**, unsigned int*, char*, char*);
-    int bget(int, char**, unsigned int*, char*, char*);
-    int bset(int, char**, unsigned int*, char*, char*);
-    int bunset(int, char**, unsigned int*, char*, char*);
-    int bladd(int, char**, unsigned int*, char*, char*);
-    int bradd(int, char**, unsigned int*, char*, char*);
-    int breload(int, char**, unsigned int*, char*, char*);
-    int balias(int, char**, unsigned int*, char*, char*);
-    int bunalias(int, char**, unsigned int*, char*, char*);
-    int bexists(int, char**, unsigned int*, char*, char*);
-    int bequals(int, char**, unsigned int*, char*, char*);
-    int bwith(int, char**, unsigned int*, char*, char*);
-    int bwithout(int, char**, unsigned int*, char*, char*);
-    int bwhich(int, char**, unsigned int*, char*, char*);
-    int bfg(int, char**, unsigned int*, char*, char*);
-    int bdebug(int, char**, unsigned int*, char*, char*);
-    int bkill(int, char**, unsigned int*, char*, char*);
-    int brun(int, char**, unsigned int*, char*, char*);
-    int bhistory(int, char**, unsigned int*, char*, char*);
-    int bsource(int, char**, unsigned int*, char*, char*);
+    int bexit(int, char**, Effects*);
+    int bcd(int, char**, Effects*);
+    int babout(int, char**, Effects*);
+    int band(int, char**, Effects*);
+    int bor(int, char**, Effects*);
+    int bredirect(int, char**, Effects*);
+    int bsilence(int, char**, Effects*);
+    int bsplit(int, char**, Effects*);
+    int bget(int, char**, Effects*);
+    int bset(int, char**, Effects*);
+    int bunset(int, char**, Effects*);
+    int bladd(int, char**, Effects*);
+    int bradd(int, char**, Effects*);
+    int breload(int, char**, Effects*);
+    int balias(int, char**, Effects*);
+    int bunalias(int, char**, Effects*);
+    int bexists(int, char**, Effects*);
+    int bequals(int, char**, Effects*);
+    int bwith(int, char**, Effects*);
+    int bwithout(int, char**, Effects*);
+    int bwhich(int, char**, Effects*);
+    int bfg(int, char**, Effects*);
+    int bbg(int, char**, Effects*);
+    int bjobs(int, char**, Effects*);
+    int bwait(int, char**, Effects*);
+    int bdebug(int, char**, Effects*);
+    int bkill(int, char**, Effects*);
+    int brun(int, char**, Effects*);
+    int bhistory(int, char**, Effects*);
+    int bsource(int, char**, Effects*);
+    int bbind(int, char**, Effects*);
+    int bstatus(int, char**, Effects*);
+    int btimeout(int, char**, Effects*);
 }
 
@@ -0,0 +1,224 @@
+#include "complete.h"
+#include "config.h"
+#include "fuzzy.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+using std::string;
+
+// Listings are read on a background thread and handed over in batches, so a huge
+// directory (or a slow mount) never holds up the keyboard
+struct DirListing {
+    std::mutex lock;
+    int64_t stamp = 0;
+    uint64_t last_used = 0; // Only touched from the main thread
+    bool complete = false;
+    std::vector<string> names;
+};
+
+// Listings are kept by device and inode rather than by name, since the same name
+// ("./", say) means a different directory after a cd
+using DirKey = std::pair<dev_t, ino_t>;
+
+static std::map<DirKey, std::shared_ptr<DirListing>> dir_cache;
+static uint64_t use_clock = 0;
+static int wake_fds[2] = { -1, -1 };
+
+static inline bool is_dot(const char *name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+// Lets the main loop know there's more of a listing to show
+static void wake() {
+    char ch = 0;
+    write(wake_fds[1], &ch, 1);
+}
+
+static void publish(DirListing &listing, std::vector<string> &batch, bool complete) {
+    {
+        std::lock_guard<std::mutex> guard(listing.lock);
+        std::move(batch.begin(), batch.end(), std::back_inserter(listing.names));
+        listing.complete = complete;
+    }
+
+    batch.clear();
+    wake();
+}
+
+static void read_listing(string dir, std::shared_ptr<DirListing> listing) {
+    std::vector<string> batch;
+
+#ifdef __linux__
+    // getdents64 hands us a whole buffer of entries per system call
+    struct linux_dirent64 {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd != -1) {
+        alignas(linux_dirent64) char buf[64 * 1024];
+        long nread;
+
+        while ((nread = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+            for (long pos = 0; pos < nread;) {
+                auto entry = (linux_dirent64*) (buf + pos);
+                pos += entry->d_reclen;
+
+                if (!is_dot(entry->d_name))
+                    batch.emplace_back(entry->d_name);
+            }
+
+            publish(*listing, batch, false);
+        }
+
+        close(fd);
+    }
+#else
+    if (DIR *dirp = opendir(dir.c_str())) {
+        while (struct dirent *entry = readdir(dirp)) {
+            if (!is_dot(entry->d_name))
+                batch.emplace_back(entry->d_name);
+
+            if (batch.size() == 1024)
+                publish(*listing, batch, false);
+        }
+
+        closedir(dirp);
+    }
+#endif
+
+    publish(*listing, batch, true);
+}
+
+// Returns the cached listing of a directory, starting a fresh read in the background
+// if we've never seen it or it has changed since we last did
+static std::shared_ptr<DirListing> list_dir(const string &dir) {
+    if (wake_fds[0] == -1) {
+        pipe(wake_fds);
+
+        for (int fd : wake_fds) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+
+    struct stat info;
+
+    // There's nothing to list, and nothing worth remembering about it
+    if (stat(dir.c_str(), &info) != 0 || !S_ISDIR(info.st_mode)) {
+        auto listing = std::make_shared<DirListing>();
+        listing->complete = true;
+        return listing;
+    }
+
+    DirKey key = { info.st_dev, info.st_ino };
+
+#ifdef __APPLE__
+    int64_t stamp = (int64_t) info.st_mtimespec.tv_sec * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+    int64_t stamp = (int64_t) info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+
+    // Don't let listings of every directory we've ever completed pile up, dropping
+    // whichever we've gone longest without using
+    if (dir_cache.size() >= DIR_CACHE_SIZE && !dir_cache.count(key)) {
+        dir_cache.erase(std::min_element(dir_cache.begin(), dir_cache.end(), [](const auto &a, const auto &b) {
+            return a.second->last_used < b.second->last_used;
+        }));
+    }
+
+    std::shared_ptr<DirListing> &listing = dir_cache[key];
+
+    if (listing) {
+        listing->last_used = ++use_clock;
+
+        if (listing->stamp == stamp)
+            return listing;
+
+        // A read of this same directory that's still going will do, rather than
+        // starting another alongside it
+        std::lock_guard<std::mutex> guard(listing->lock);
+
+        if (!listing->complete)
+            return listing;
+    }
+
+    listing = std::make_shared<DirListing>();
+    listing->stamp = stamp;
+    listing->last_used = ++use_clock;
+
+    std::thread(read_listing, dir, listing).detach();
+
+    return listing;
+}
+
+// Fuzzily completes a path from whatever part of its directory's listing we have so far.
+// partial is set when more entries are still on their way.
+std::vector<string> complete_path(const string &path, bool *partial) {
+    auto idx = path.find_last_of('/');
+    string head;
+    string dir;
+    string search_for;
+    std::vector<string> paths;
+
+    if (idx != string::npos) {
+        head = path.substr(0, idx + 1);
+        dir = head;
+        search_for = path.substr(idx + 1);
+    } else {
+        head = "./";
+        dir = head;
+        search_for = path;
+    }
+
+    FuzzyPattern pattern = fuzzy_pattern(search_for);
+    std::vector<FuzzyMatch> found;
+    std::shared_ptr<DirListing> listing = list_dir(dir);
+    std::lock_guard<std::mutex> guard(listing->lock);
+    int score;
+
+    for (const string &name : listing->names) {
+        if (fuzzy_match(pattern, name, &score))
+            found.push_back({ score, name });
+    }
+
+    for (string &name : rank_matches(found))
+        paths.push_back(head + name);
+
+    if (partial != nullptr)
+        *partial = !listing->complete;
+
+    return paths;
+}
+
+int completion_wake_fd() {
+    return wake_fds[0];
+}
+
+void drain_completion_wake() {
+    char buf[64];
+
+    while (read(wake_fds[0], buf, sizeof(buf)) > 0);
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+std::vector<std::string> complete_path(const std::string&, bool* = nullptr);
+int completion_wake_fd();
+void drain_completion_wake();
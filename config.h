@@ -5,8 +5,42 @@
 #define VERSION_PATCH 1
 
 #define COMPLETION_COLUMNS 5
+#define PATH_SCAN_THREADS  8
+#define DIR_CACHE_SIZE     32
+#define INPUT_BUFFER_SIZE  65536
 
-#define SHELL_NAME     "wsh"
-#define DEFAULT_PROMPT "$ "
-#define RC_FILENAME    ".wshrc"
-#define HIST_FILENAME  ".wsh_history"
+// Subcommand output is read this much at a time at least, through a pipe this big
+#define CAPTURE_READ_SIZE  65536
+#define CAPTURE_PIPE_SIZE  (1 << 20)
+
+// How often to look in on children when they can't be watched through pidfds
+#define CHILD_POLL_MS      50
+
+// How long a command timeout has given up on gets to exit before it's killed outright
+#define TIMEOUT_KILL_MS    5000
+
+// How long to wait for the rest of an escape sequence
+#define ESCAPE_TIMEOUT_MS  25
+
+// How long to wait for the terminal to say where the cursor is
+#define CURSOR_QUERY_MS    100
+
+#define SHELL_NAME        "wsh"
+#define DEFAULT_PROMPT    "$ "
+#define RC_FILENAME       ".wshrc"
+#define HIST_FILENAME     ".wsh_history"
+#define SNAPSHOT_FILENAME ".wsh_snapshot"
+
+// Set to 0 to launch external commands with fork() and execv() instead
+#define USE_POSIX_SPAWN 1
+
+// Set to 0 to always run the rc file instead of restoring a snapshot of it
+#define USE_SNAPSHOT 1
+
+// The history file is compacted once it's bigger than this many bytes, and twice the
+// size it was after it was last compacted
+#define HIST_COMPACT_SIZE (1 << 20)
+
+// Reverse search indexes commands entered since the history was last indexed once
+// there are more than this many of them, and reads through them one by one until then
+#define HIST_PENDING_MAX  4096
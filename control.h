@@ -20,8 +20,6 @@
 #define DIRECTION_RIGHT 2
 #define DIRECTION_LEFT  3
 
-#define INSERT_END   -1
-
 #define FLAG_EXIT    1 <<  0
 #define FLAG_CD      1 <<  1
 #define FLAG_SKIP    1 <<  2
@@ -37,3 +35,12 @@
 #define FLAG_KILL    1 << 12
 #define FLAG_RUN     1 << 13
 #define FLAG_SOURCE  1 << 14
+#define FLAG_BIND    1 << 15
+#define FLAG_BG      1 << 16
+#define FLAG_WAIT    1 << 17
+#define FLAG_SPLIT   1 << 18
+
+#define EXPAND_VARIABLES 1 << 0
+#define EXPAND_TILDES    1 << 1
+#define EXPAND_ESCAPES   1 << 2
+#define EXPAND_ALL       (EXPAND_VARIABLES | EXPAND_TILDES | EXPAND_ESCAPES)
@@ -0,0 +1,210 @@
+#include "fuzzy.h"
+
+#include <algorithm>
+#include <cctype>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using std::string;
+
+// Scoring follows fzf: every matched character is worth the same, with bonuses for
+// landing on word boundaries or running on from the last match and penalties for gaps
+constexpr int SCORE_MATCH        = 16;
+constexpr int SCORE_GAP_START    = -3;
+constexpr int SCORE_GAP_EXTEND   = -1;
+constexpr int BONUS_DELIMITER    = 9;
+constexpr int BONUS_BOUNDARY     = 8;
+constexpr int BONUS_NON_WORD     = 8;
+constexpr int BONUS_CAMEL        = 7;
+constexpr int BONUS_CONSECUTIVE  = -(SCORE_GAP_START + SCORE_GAP_EXTEND);
+constexpr int BONUS_FIRST_FACTOR = 2;
+
+enum CharClass { CLASS_DELIMITER, CLASS_NON_WORD, CLASS_LOWER, CLASS_UPPER, CLASS_DIGIT };
+
+static CharClass char_class(unsigned char ch) {
+    if (islower(ch) || ch >= 0x80)
+        return CLASS_LOWER;
+    if (isupper(ch))
+        return CLASS_UPPER;
+    if (isdigit(ch))
+        return CLASS_DIGIT;
+    if (isspace(ch) || ch == '/' || ch == ',' || ch == ':' || ch == ';' || ch == '|')
+        return CLASS_DELIMITER;
+
+    return CLASS_NON_WORD;
+}
+
+static int char_bonus(CharClass prev, CharClass cur) {
+    if (cur >= CLASS_LOWER) {
+        if (prev == CLASS_DELIMITER)
+            return BONUS_DELIMITER;
+        if (prev == CLASS_NON_WORD)
+            return BONUS_BOUNDARY;
+        if ((prev == CLASS_LOWER && cur == CLASS_UPPER) || (prev != CLASS_DIGIT && cur == CLASS_DIGIT))
+            return BONUS_CAMEL;
+
+        return 0;
+    }
+
+    return BONUS_NON_WORD;
+}
+
+static inline char fold(char ch, bool ignore_case) {
+    return ignore_case ? tolower((unsigned char) ch) : ch;
+}
+
+// Index of the first byte at or after pos that might be ch. When ignoring case every
+// byte has 0x20 set before comparing, which can let through bytes that aren't
+// really ch but never turns away one that is.
+static size_t find_byte(const char *str, size_t len, size_t pos, char ch, bool ignore_case) {
+    char mask = ignore_case ? 0x20 : 0;
+    ch |= mask;
+
+#ifdef __SSE2__
+    __m128i needle = _mm_set1_epi8(ch);
+    __m128i folds = _mm_set1_epi8(mask);
+
+    for (; pos + 16 <= len; pos += 16) {
+        __m128i chunk = _mm_or_si128(_mm_loadu_si128((const __m128i*) (str + pos)), folds);
+        int found = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+
+        if (found != 0)
+            return pos + __builtin_ctz(found);
+    }
+#endif
+
+    for (; pos < len; ++pos) {
+        if ((str[pos] | mask) == ch)
+            return pos;
+    }
+
+    return string::npos;
+}
+
+// Cheaply rules out candidates that can't contain the pattern as a subsequence,
+// sixteen bytes at a time, so only likely matches are scored properly
+static bool prefilter(const string &pattern, const string &candidate, bool ignore_case) {
+    size_t pos = 0;
+
+    for (char ch : pattern) {
+        pos = find_byte(candidate.data(), candidate.length(), pos, ch, ignore_case);
+
+        if (pos == string::npos)
+            return false;
+
+        ++pos;
+    }
+
+    return true;
+}
+
+// Matching ignores case unless the pattern has an uppercase letter in it
+FuzzyPattern fuzzy_pattern(const string &text) {
+    bool ignore_case = std::none_of(text.begin(), text.end(), [](unsigned char ch) { return isupper(ch); });
+    return { text, ignore_case };
+}
+
+// Whether candidate contains the pattern's characters in order, and if so how good
+// a match it is. Like fzf's v1 algorithm, this finds the first place the pattern
+// can end, then walks back from there for the shortest stretch that holds it.
+bool fuzzy_match(const FuzzyPattern &pattern, const string &candidate, int *score) {
+    const string &text = pattern.text;
+    bool ignore_case = pattern.ignore_case;
+
+    if (text.empty()) {
+        *score = 0;
+        return true;
+    }
+
+    if (text.length() > candidate.length() || !prefilter(text, candidate, ignore_case))
+        return false;
+
+    size_t idx = 0;
+    size_t end = 0;
+
+    for (size_t i = 0; i < candidate.length(); ++i) {
+        if (fold(candidate[i], ignore_case) == text[idx] && ++idx == text.length()) {
+            end = i;
+            break;
+        }
+    }
+
+    if (idx < text.length())
+        return false;
+
+    size_t start = end;
+
+    for (long i = end, j = text.length() - 1; i >= 0; --i) {
+        if (fold(candidate[i], ignore_case) == text[j] && --j < 0) {
+            start = i;
+            break;
+        }
+    }
+
+    CharClass prev = start > 0 ? char_class(candidate[start - 1]) : CLASS_DELIMITER;
+    int total = 0;
+    int first_bonus = 0;
+    int consecutive = 0;
+    bool in_gap = false;
+    idx = 0;
+
+    for (size_t i = start; i <= end; ++i) {
+        CharClass cur = char_class(candidate[i]);
+
+        if (fold(candidate[i], ignore_case) == text[idx]) {
+            int bonus = char_bonus(prev, cur);
+
+            if (consecutive == 0) {
+                first_bonus = bonus;
+            } else {
+                // A run keeps the bonus of the boundary it started on
+                if (bonus >= BONUS_BOUNDARY && bonus > first_bonus)
+                    first_bonus = bonus;
+
+                bonus = std::max({ bonus, first_bonus, BONUS_CONSECUTIVE });
+            }
+
+            total += SCORE_MATCH + (idx == 0 ? bonus * BONUS_FIRST_FACTOR : bonus);
+            in_gap = false;
+            ++consecutive;
+            ++idx;
+        } else {
+            total += in_gap ? SCORE_GAP_EXTEND : SCORE_GAP_START;
+            in_gap = true;
+            consecutive = 0;
+            first_bonus = 0;
+        }
+
+        prev = cur;
+    }
+
+    *score = total;
+    return true;
+}
+
+// Best matches first, then shorter ones, then alphabetically. The same text showing
+// up more than once (a builtin that's also on the PATH, say) is only listed once.
+std::vector<string> rank_matches(std::vector<FuzzyMatch> &found) {
+    std::sort(found.begin(), found.end(), [](const FuzzyMatch &a, const FuzzyMatch &b) {
+        if (a.score != b.score)
+            return a.score > b.score;
+
+        // An empty pattern scores everything 0, and then plain alphabetical order reads best
+        if (a.score != 0 && a.text.length() != b.text.length())
+            return a.text.length() < b.text.length();
+
+        return a.text < b.text;
+    });
+
+    std::vector<string> output;
+    output.reserve(found.size());
+
+    for (FuzzyMatch &match : found) {
+        if (output.empty() || output.back() != match.text)
+            output.push_back(std::move(match.text));
+    }
+
+    return output;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+struct FuzzyPattern {
+    std::string text;
+    bool ignore_case;
+};
+
+struct FuzzyMatch {
+    int score;
+    std::string text;
+};
+
+FuzzyPattern fuzzy_pattern(const std::string&);
+bool fuzzy_match(const FuzzyPattern&, const std::string&, int*);
+std::vector<std::string> rank_matches(std::vector<FuzzyMatch>&);
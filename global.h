@@ -1,5 +1,8 @@
 #pragma once
 
+#include "builtins.h"
+
+#include <csignal>
 #include <map>
 #include <string>
 #include <vector>
@@ -9,9 +12,9 @@ extern std::string prev_dir;
 extern bool skip_next;
 extern bool echo_input;
 extern bool with_var;
+extern volatile sig_atomic_t interrupted;
 extern std::map<std::string, std::string> executable_map;
 extern std::map<std::string, std::string> alias_map;
-extern std::map<std::string, int (*)(int, char**, unsigned int*, char*, char*)> builtins_map;
-extern std::vector<std::string> history;
-extern std::vector<pid_t> suspended_pids;
+extern std::map<std::string, builtin_fn> builtins_map;
+extern std::vector<int> pipeline_status;
 
@@ -0,0 +1,539 @@
+#include "config.h"
+#include "history.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using std::string;
+
+// The history file is a log that every shell appends each command to as it's entered,
+// oldest first, under a header recording how big the file was after its last
+// compaction. Once it has grown well past that, the next shell to notice rewrites it
+// with only the newest copy of each command. Files from before the header existed
+// hold their newest commands first, and are compacted into a log the first time
+// they're loaded.
+
+#define HIST_HEADER "#wsh-history "
+
+// Commands are kept oldest first in an arena, so adding one is an append. The file is
+// read into it whole when the shell starts, and its commands are left where they are.
+// It isn't mapped, since anything truncating the file would then take us down with
+// SIGBUS. Each command is followed by a newline, so only where it starts is recorded.
+static std::vector<uint32_t> offsets;
+static string arena;
+
+static size_t compacted_size = 0;
+static int log_fd = -1;
+
+// Reverse search looks commands up through an index of every three-byte sequence in
+// the history. Each trigram's list of entries is stored as the gaps between them, as
+// varints, all packed into one arena, with a table sorted by trigram saying where
+// each list starts. The index only covers the commands there were when it was built;
+// the rest are searched one by one until there are enough of them to index again.
+struct TrigramList {
+    uint32_t trigram;
+    uint32_t count;
+    uint32_t offset;
+};
+
+struct TrigramIndex {
+    std::vector<TrigramList> table;
+    string postings;
+    size_t count = 0;
+};
+
+// A long history takes long enough to index that it would hold up startup, so it's
+// done on a thread. Nothing waits for it: until it's done, searches read through the
+// whole history. The thread only holds arena_lock while it reads a command, which is
+// all adding one has to wait for.
+static std::mutex arena_lock;
+static std::mutex index_lock;
+static std::condition_variable index_done;
+static std::shared_ptr<const TrigramIndex> trigram_index;
+static bool indexing = false;
+static std::atomic<bool> stop_indexing = false;
+static pid_t indexing_pid = 0;
+
+static string history_path() {
+    return home_dir() + '/' + HIST_FILENAME;
+}
+
+// Returns a command from the history, counting up from the oldest
+static std::string_view entry(size_t id) {
+    size_t end = id + 1 < offsets.size() ? offsets[id + 1] : arena.length();
+
+    return { arena.data() + offsets[id], end - offsets[id] - 1 };
+}
+
+static void append_entry(std::string_view cmd) {
+    std::lock_guard<std::mutex> guard(arena_lock);
+
+    offsets.push_back(arena.length());
+    arena += cmd;
+    arena += '\n';
+}
+
+static inline uint32_t trigram_at(std::string_view str, size_t pos) {
+    return (uint8_t) str[pos] << 16 | (uint8_t) str[pos + 1] << 8 | (uint8_t) str[pos + 2];
+}
+
+static size_t varint_length(uint32_t value) {
+    size_t len = 1;
+
+    while (value >= 0x80) {
+        value >>= 7;
+        ++len;
+    }
+
+    return len;
+}
+
+static void put_varint(char *&p, uint32_t value) {
+    while (value >= 0x80) {
+        *p++ = (char) (value | 0x80);
+        value >>= 7;
+    }
+
+    *p++ = (char) value;
+}
+
+static uint32_t get_varint(const char *&p) {
+    uint32_t value = 0;
+
+    for (int shift = 0;; shift += 7) {
+        uint8_t byte = *p++;
+        value |= (uint32_t) (byte & 0x7f) << shift;
+
+        if (!(byte & 0x80))
+            return value;
+    }
+}
+
+// Calls fn with every trigram of each of the oldest count commands, oldest first.
+// Returns false if the shell is exiting and we gave up part way.
+template <typename Fn>
+static bool each_trigram(size_t count, Fn fn) {
+    for (size_t id = 0; id < count; ++id) {
+        std::lock_guard<std::mutex> guard(arena_lock);
+        std::string_view cmd = entry(id);
+
+        if (stop_indexing)
+            return false;
+
+        for (size_t pos = 0; pos + 3 <= cmd.length(); ++pos)
+            fn(trigram_at(cmd, pos), id);
+    }
+
+    return true;
+}
+
+// Indexes the oldest count commands in two passes: one to size each trigram's list,
+// and one to write the lists out where they belong
+static void build_index(size_t count) {
+    struct Cursor {
+        uint32_t last;
+        uint32_t count;
+        uint32_t size;
+    };
+
+    std::unordered_map<uint32_t, Cursor> cursors;
+    auto index = std::make_shared<TrigramIndex>();
+
+    bool done = each_trigram(count, [&](uint32_t trigram, uint32_t id) {
+        Cursor &cursor = cursors[trigram];
+
+        // A trigram can show up more than once in the same command
+        if (cursor.count > 0 && cursor.last == id)
+            return;
+
+        cursor.size += varint_length(cursor.count > 0 ? id - cursor.last : id);
+        cursor.last = id;
+        ++cursor.count;
+    });
+
+    if (done) {
+        index->table.reserve(cursors.size());
+
+        for (const auto &[trigram, cursor] : cursors)
+            index->table.push_back({ trigram, cursor.count, 0 });
+
+        std::sort(index->table.begin(), index->table.end(), [](const TrigramList &a, const TrigramList &b) {
+            return a.trigram < b.trigram;
+        });
+
+        // From here on each cursor's size is where the rest of its list gets written
+        uint32_t offset = 0;
+
+        for (TrigramList &list : index->table) {
+            Cursor &cursor = cursors[list.trigram];
+
+            list.offset = offset;
+            offset += cursor.size;
+            cursor = { 0, 0, list.offset };
+        }
+
+        index->postings.assign(offset, '\0');
+        index->count = count;
+
+        done = each_trigram(count, [&](uint32_t trigram, uint32_t id) {
+            Cursor &cursor = cursors[trigram];
+
+            if (cursor.count > 0 && cursor.last == id)
+                return;
+
+            char *p = index->postings.data() + cursor.size;
+            put_varint(p, cursor.count > 0 ? id - cursor.last : id);
+            cursor.size = p - index->postings.data();
+            cursor.last = id;
+            ++cursor.count;
+        });
+    }
+
+    std::lock_guard<std::mutex> guard(index_lock);
+
+    if (done)
+        trigram_index = std::move(index);
+
+    indexing = false;
+    index_done.notify_all();
+}
+
+// Starts indexing every command we have so far. index_lock has to be held.
+static void start_index() {
+    indexing = true;
+    indexing_pid = getpid();
+    std::thread(build_index, offsets.size()).detach();
+}
+
+// Keeps the shell from tearing down the history while it's still being indexed.
+// Forked children don't have the indexing thread, so they mustn't wait on it.
+static void finish_index() {
+    if (getpid() != indexing_pid)
+        return;
+
+    std::unique_lock<std::mutex> guard(index_lock);
+    stop_indexing = true;
+    index_done.wait(guard, [] { return !indexing; });
+}
+
+// Returns the entries holding a trigram, oldest first, or nullptr if none do
+static const TrigramList* find_trigram(const TrigramIndex &index, uint32_t trigram) {
+    auto it = std::lower_bound(index.table.begin(), index.table.end(), trigram, [](const TrigramList &list, uint32_t value) {
+        return list.trigram < value;
+    });
+
+    return it != index.table.end() && it->trigram == trigram ? &*it : nullptr;
+}
+
+static void decode_list(const TrigramIndex &index, const TrigramList &list, std::vector<uint32_t> &ids) {
+    const char *p = index.postings.data() + list.offset;
+    uint32_t id = 0;
+
+    ids.resize(list.count);
+
+    for (uint32_t i = 0; i < list.count; ++i) {
+        id += get_varint(p);
+        ids[i] = id;
+    }
+}
+
+static bool log_is_current() {
+    struct stat path_info, fd_info;
+
+    return log_fd != -1 && stat(history_path().c_str(), &path_info) == 0 && fstat(log_fd, &fd_info) == 0
+        && path_info.st_dev == fd_info.st_dev && path_info.st_ino == fd_info.st_ino;
+}
+
+// Locks the history file, reopening it first if another shell has compacted it
+// since we opened it
+static bool lock_log(int operation) {
+    for (;;) {
+        if (!log_is_current()) {
+            if (log_fd != -1)
+                close(log_fd);
+
+            log_fd = open(history_path().c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+
+            if (log_fd == -1)
+                return false;
+        }
+
+        while (flock(log_fd, operation) == -1) {
+            if (errno != EINTR)
+                return false;
+        }
+
+        // It could have been replaced while we waited for the lock
+        if (log_is_current())
+            return true;
+
+        flock(log_fd, LOCK_UN);
+    }
+}
+
+static void unlock_log() {
+    flock(log_fd, LOCK_UN);
+}
+
+static bool log_too_big(off_t size) {
+    return size > (off_t) std::max<size_t>(HIST_COMPACT_SIZE, compacted_size * 2);
+}
+
+// Splits the contents of a history file into its commands, oldest first. Returns false
+// if the file is in the old format, newest first and with no header.
+static bool parse_log(std::string_view data, std::vector<std::string_view> &entries) {
+    size_t pos = 0;
+    bool current = data.empty() || data.compare(0, strlen(HIST_HEADER), HIST_HEADER) == 0;
+
+    entries.clear();
+
+    if (!data.empty() && current) {
+        pos = data.find('\n');
+        compacted_size = strtoull(data.data() + strlen(HIST_HEADER), nullptr, 10);
+        pos = pos == string::npos ? data.length() : pos + 1;
+    }
+
+    while (pos < data.length()) {
+        size_t end = data.find('\n', pos);
+
+        if (end == string::npos)
+            end = data.length();
+
+        entries.push_back(data.substr(pos, end - pos));
+        pos = end + 1;
+    }
+
+    if (!current)
+        std::reverse(entries.begin(), entries.end());
+
+    return current;
+}
+
+// Reads the locked history file into data and splits it into commands
+static bool read_log(string &data, std::vector<std::string_view> &entries) {
+    struct stat info;
+
+    data.clear();
+
+    if (fstat(log_fd, &info) == 0 && info.st_size > 0) {
+        // Room for the history to grow, which costs nothing until it's used
+        data.reserve(info.st_size + info.st_size / 2);
+        data.resize(info.st_size);
+        ssize_t nread = pread(log_fd, data.data(), data.length(), 0);
+        data.resize(nread > 0 ? nread : 0);
+    }
+
+    return parse_log(data, entries);
+}
+
+// Rewrites the history file with only the newest copy of each command, if it still
+// needs it once we have it to ourselves. Other shells wait on the lock to append, and
+// then see that the file they have open has been replaced.
+static void compact_log() {
+    if (!lock_log(LOCK_EX))
+        return;
+
+    string data;
+    std::vector<std::string_view> found;
+
+    if (read_log(data, found) && !log_too_big(data.length())) {
+        unlock_log();
+        return;
+    }
+
+    std::unordered_set<std::string_view> seen;
+    std::vector<std::string_view> kept;
+    string body;
+
+    for (auto it = found.rbegin(); it != found.rend(); ++it) {
+        if (seen.insert(*it).second)
+            kept.push_back(*it);
+    }
+
+    for (auto it = kept.rbegin(); it != kept.rend(); ++it) {
+        body += *it;
+        body += '\n';
+    }
+
+    string contents = HIST_HEADER + std::to_string(body.length()) + '\n' + body;
+    string path = history_path();
+    string tmp_path = path + "." + std::to_string(getpid());
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+    if (fd != -1) {
+        ssize_t nwritten = write(fd, contents.data(), contents.length());
+        close(fd);
+
+        if (nwritten == (ssize_t) contents.length() && rename(tmp_path.c_str(), path.c_str()) == 0)
+            compacted_size = body.length();
+        else
+            unlink(tmp_path.c_str());
+    }
+
+    unlock_log();
+}
+
+void load_history() {
+    string data;
+    std::vector<std::string_view> entries;
+    bool current = false;
+    bool compact = false;
+
+    if (lock_log(LOCK_SH)) {
+        current = read_log(data, entries);
+        compact = !current || log_too_big(data.length());
+        unlock_log();
+    }
+
+    if (compact) {
+        compact_log();
+
+        if (lock_log(LOCK_SH)) {
+            current = read_log(data, entries);
+            unlock_log();
+        }
+    }
+
+    offsets.reserve(entries.size() + entries.size() / 2);
+
+    if (current && !entries.empty()) {
+        for (std::string_view cmd : entries)
+            offsets.push_back(cmd.data() - data.data());
+
+        // Whatever follows the last command goes, and it gets its newline if it was missing one
+        size_t end = offsets.back() + entries.back().length();
+
+        arena = std::move(data);
+        arena.resize(end);
+        arena += '\n';
+    } else if (!current) {
+        // An old file we couldn't convert, so it has to be copied the right way round
+        for (std::string_view cmd : entries)
+            append_entry(cmd);
+    }
+
+    std::lock_guard<std::mutex> guard(index_lock);
+    std::atexit(finish_index);
+    start_index();
+}
+
+// Adds a command to the history, and appends it to the history file in a single write
+void add_history(const string &cmd) {
+    append_entry(cmd);
+
+    // Exclusive, since the first shell to write to a new file also has to write its header
+    if (!lock_log(LOCK_EX))
+        return;
+
+    struct stat info;
+    string line = cmd + '\n';
+
+    if (fstat(log_fd, &info) != 0)
+        info.st_size = 0;
+
+    if (info.st_size == 0)
+        line.insert(0, HIST_HEADER "0\n");
+
+    write(log_fd, line.data(), line.length());
+    unlock_log();
+
+    if (log_too_big(info.st_size + line.length()))
+        compact_log();
+}
+
+size_t history_size() {
+    return offsets.size();
+}
+
+// Returns a command from the history, counting back from the newest. It's only good
+// until the next command is added.
+std::string_view history_at(size_t idx) {
+    return entry(offsets.size() - 1 - idx);
+}
+
+// Returns the index into the history of the newest command at or after from that
+// contains query, or -1 if there isn't one
+int search_history(const string &query, int from) {
+    if (from < 0 || from >= (int) offsets.size())
+        return -1;
+
+    size_t newest = offsets.size() - 1 - from;
+
+    // Too short to have trigrams, but then nearly everything matches and we won't be
+    // looking for long
+    if (query.length() < 3) {
+        for (size_t idx = from; idx < offsets.size(); ++idx) {
+            if (history_at(idx).find(query) != string::npos)
+                return idx;
+        }
+
+        return -1;
+    }
+
+    std::shared_ptr<const TrigramIndex> index;
+
+    {
+        std::lock_guard<std::mutex> guard(index_lock);
+        index = trigram_index;
+
+        if (!indexing && offsets.size() - (index ? index->count : 0) > HIST_PENDING_MAX)
+            start_index();
+    }
+
+    size_t indexed = index ? index->count : 0;
+
+    // Whatever isn't in the index yet, which is everything until it's first built
+    for (size_t id = newest + 1; id-- > indexed;) {
+        if (entry(id).find(query) != string::npos)
+            return offsets.size() - 1 - id;
+    }
+
+    if (indexed == 0)
+        return -1;
+
+    // Only commands holding every one of the query's trigrams can match, so it's
+    // enough to check the ones holding its rarest
+    const TrigramList *rarest = nullptr;
+
+    for (size_t pos = 0; pos + 3 <= query.length(); ++pos) {
+        const TrigramList *list = find_trigram(*index, trigram_at(query, pos));
+
+        if (list == nullptr)
+            return -1;
+
+        if (rarest == nullptr || list->count < rarest->count)
+            rarest = list;
+    }
+
+    std::vector<uint32_t> ids;
+    decode_list(*index, *rarest, ids);
+
+    auto it = std::upper_bound(ids.begin(), ids.end(), (uint32_t) newest);
+
+    while (it != ids.begin()) {
+        uint32_t id = *--it;
+
+        if (entry(id).find(query) != string::npos)
+            return offsets.size() - 1 - id;
+    }
+
+    return -1;
+}
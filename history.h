@@ -0,0 +1,10 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+void load_history();
+void add_history(const std::string&);
+size_t history_size();
+std::string_view history_at(size_t);
+int search_history(const std::string&, int);
@@ -0,0 +1,315 @@
+#include "config.h"
+#include "input.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <string_view>
+#include <termios.h>
+#include <unistd.h>
+
+using std::string;
+
+// The terminal stays in raw mode for as long as the line editor has it, rather than
+// being switched for every key, and input is read a buffer at a time. Keys come out
+// of the buffer whole: a run of text, a control character, a complete escape
+// sequence or, with bracketed paste turned on, everything that was pasted at once.
+
+#define PASTE_START "\e[200~"
+#define PASTE_END   "\e[201~"
+
+static struct termios cooked;
+static bool raw_active = false;
+static bool restore_registered = false;
+
+static char buf[INPUT_BUFFER_SIZE];
+static size_t buf_pos = 0;
+static size_t buf_len = 0;
+
+static void restore_terminal() {
+    raw_mode_off();
+}
+
+// Turns off line buffering and echo. Returns false if the terminal was already in raw
+// mode, or can't be put in it.
+bool raw_mode_on() {
+    if (raw_active || tcgetattr(STDIN_FILENO, &cooked) != 0)
+        return false;
+
+    struct termios raw = cooked;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+
+    raw_active = tcsetattr(STDIN_FILENO, TCSANOW, &raw) == 0;
+
+    if (raw_active)
+        std::cout << "\e[?2004h" << std::flush; // Bracketed paste on
+
+    if (raw_active && !restore_registered) {
+        std::atexit(restore_terminal);
+        restore_registered = true;
+    }
+
+    return raw_active;
+}
+
+// Gives the terminal back the way it was, for running commands and on the way out.
+// Returns whether it had been in raw mode.
+bool raw_mode_off() {
+    if (!raw_active)
+        return false;
+
+    std::cout << "\e[?2004l" << std::flush; // Bracketed paste off
+    tcsetattr(STDIN_FILENO, TCSANOW, &cooked);
+    raw_active = false;
+
+    return true;
+}
+
+// Reads whatever input is available into the buffer, first waiting up to timeout
+// milliseconds for some to arrive, or forever if timeout is negative. Returns how
+// many bytes were read, 0 on timeout or at the end of the input and -1 if a signal
+// interrupted us.
+static ssize_t fill(int timeout) {
+    // Anything drawn so far should be on screen before we wait on the user
+    std::cout << std::flush;
+
+    if (buf_pos > 0) {
+        memmove(buf, buf + buf_pos, buf_len - buf_pos);
+        buf_len -= buf_pos;
+        buf_pos = 0;
+    }
+
+    if (buf_len == sizeof(buf))
+        return 0;
+
+    if (timeout >= 0) {
+        struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+        int ready = poll(&pfd, 1, timeout);
+
+        if (ready <= 0)
+            return ready;
+    }
+
+    ssize_t nread = read(STDIN_FILENO, buf + buf_len, sizeof(buf) - buf_len);
+
+    if (nread > 0)
+        buf_len += nread;
+
+    return nread;
+}
+
+// Reads a single byte of input
+char getch() {
+    while (buf_pos == buf_len) {
+        if (fill(-1) <= 0)
+            return EOF;
+    }
+
+    return buf[buf_pos++];
+}
+
+bool input_pending() {
+    return buf_pos < buf_len;
+}
+
+static inline bool is_control(unsigned char ch) {
+    return ch < 0x20 || ch == 0x7f;
+}
+
+static size_t utf8_length(unsigned char lead) {
+    if ((lead & 0xe0) == 0xc0)
+        return 2;
+    if ((lead & 0xf0) == 0xe0)
+        return 3;
+    if ((lead & 0xf8) == 0xf0)
+        return 4;
+
+    // ASCII, and stray continuation bytes, which are taken one at a time
+    return 1;
+}
+
+// Length of the escape sequence at the start of str, or 0 if it hasn't all arrived
+static size_t escape_length(const char *str, size_t len) {
+    if (len < 2)
+        return 0;
+
+    // CSI sequences run until a final byte, which is anything from @ to ~
+    if (str[1] == '[') {
+        for (size_t i = 2; i < len; ++i) {
+            if (str[i] >= 0x40 && str[i] <= 0x7e)
+                return i + 1;
+            if (is_control(str[i]))
+                return i;
+        }
+
+        return 0;
+    }
+
+    // SS3 sequences, which some terminals send for the arrows and F1-F4
+    if (str[1] == 'O')
+        return len < 3 ? 0 : 3;
+
+    // Some terminals send Alt and a key with its own sequence as ESC and that sequence
+    if (str[1] == 0x1b) {
+        size_t inner = escape_length(str + 1, len - 1);
+        return inner == 0 ? 0 : inner + 1;
+    }
+
+    // Anything else is Alt and a key
+    return 2;
+}
+
+// Collects everything up to the end of a paste, however many reads that takes
+static void read_paste(string &text) {
+    const size_t end_len = strlen(PASTE_END);
+
+    text.clear();
+
+    for (;;) {
+        std::string_view pending(buf + buf_pos, buf_len - buf_pos);
+        size_t end = pending.find(PASTE_END);
+
+        if (end != string::npos) {
+            text.append(pending.substr(0, end));
+            buf_pos += end + end_len;
+            return;
+        }
+
+        // Hold back anything that could be the start of the end marker
+        size_t keep = std::min(pending.length(), end_len - 1);
+        text.append(pending.substr(0, pending.length() - keep));
+        buf_pos += pending.length() - keep;
+
+        if (fill(-1) <= 0) {
+            text.append(buf + buf_pos, buf_len - buf_pos);
+            buf_pos = buf_len;
+            return;
+        }
+    }
+}
+
+// Takes the next key out of the input. Returns 1 if there was one, 0 at the end of
+// the input and -1 if a signal interrupted us.
+int read_key(Key *key) {
+    while (buf_pos == buf_len) {
+        ssize_t nread = fill(-1);
+
+        if (nread <= 0)
+            return nread;
+    }
+
+    unsigned char ch = buf[buf_pos];
+
+    if (ch == 0x1b) {
+        size_t len;
+
+        // On its own this is either the escape key or the start of a sequence that
+        // hasn't all arrived yet, and only waiting a moment tells us which
+        while ((len = escape_length(buf + buf_pos, buf_len - buf_pos)) == 0) {
+            if (fill(ESCAPE_TIMEOUT_MS) <= 0) {
+                len = buf_len - buf_pos;
+                break;
+            }
+        }
+
+        key->type = KEY_ESCAPE;
+        key->text.assign(buf + buf_pos, len);
+        buf_pos += len;
+
+        if (key->text == PASTE_START) {
+            key->type = KEY_PASTE;
+            read_paste(key->text);
+        }
+
+        return 1;
+    }
+
+    if (is_control(ch)) {
+        key->type = KEY_CONTROL;
+        key->text.assign(1, ch);
+        ++buf_pos;
+
+        return 1;
+    }
+
+    key->type = KEY_TEXT;
+    key->text.clear();
+
+    for (;;) {
+        while (buf_pos < buf_len && !is_control(buf[buf_pos])) {
+            size_t len = utf8_length(buf[buf_pos]);
+
+            if (buf_len - buf_pos < len)
+                break;
+
+            key->text.append(buf + buf_pos, len);
+            buf_pos += len;
+        }
+
+        if (buf_pos == buf_len || is_control(buf[buf_pos]) || !key->text.empty())
+            return 1;
+
+        // Only part of a character has arrived. If the rest of it doesn't show up,
+        // take what there is.
+        if (fill(ESCAPE_TIMEOUT_MS) <= 0) {
+            key->text.append(buf + buf_pos, buf_len - buf_pos);
+            buf_pos = buf_len;
+
+            return 1;
+        }
+    }
+}
+
+// Length of the cursor position report ("ESC [ row ; column R") at the start of str,
+// or 0 if there isn't a whole one there
+static size_t report_length(const char *str, size_t len) {
+    size_t i = 2;
+    bool semicolon = false;
+
+    if (len < 2 || str[0] != 0x1b || str[1] != '[')
+        return 0;
+
+    for (; i < len; ++i) {
+        if (str[i] == ';' && !semicolon)
+            semicolon = true;
+        else if (!isdigit((unsigned char) str[i]))
+            break;
+    }
+
+    return semicolon && i < len && str[i] == 'R' ? i + 1 : 0;
+}
+
+// Asks the terminal which column the cursor is in, counting from 1. Returns -1 if it
+// doesn't answer in time. Keys typed before the answer arrived are left for read_key.
+int cursor_column() {
+    if (!raw_active)
+        return -1;
+
+    std::cout << "\e[6n" << std::flush;
+
+    for (;;) {
+        for (size_t pos = buf_pos; pos < buf_len; ++pos) {
+            size_t len = report_length(buf + pos, buf_len - pos);
+
+            if (len == 0)
+                continue;
+
+            int column = atoi((const char*) memchr(buf + pos, ';', len) + 1);
+
+            memmove(buf + pos, buf + pos + len, buf_len - pos - len);
+            buf_len -= len;
+
+            return column;
+        }
+
+        // A signal arriving is no reason to give up on the answer
+        if (fill(CURSOR_QUERY_MS) == 0)
+            return -1;
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+
+enum KeyType {
+    KEY_TEXT,    // A run of printable characters, whole UTF-8 sequences included
+    KEY_CONTROL, // A single control character
+    KEY_ESCAPE,  // A whole escape sequence, starting with ESC
+    KEY_PASTE,   // Everything the terminal says was pasted, as it was pasted
+};
+
+struct Key {
+    KeyType type;
+    std::string text;
+};
+
+bool raw_mode_on();
+bool raw_mode_off();
+char getch();
+bool input_pending();
+int read_key(Key*);
+int cursor_column();
@@ -0,0 +1,530 @@
+#include "config.h"
+#include "global.h"
+#include "jobs.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <iterator>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using std::string;
+
+// Pipelines that go into the background, or get stopped, are kept in the job table until
+// every process in them has been reaped. Children are reaped as they finish rather than
+// whenever the next command runs: SIGCHLD writes to a pipe the main loop watches, and
+// reap_jobs collects whatever's finished without blocking. Only processes in the table
+// are waited on, so foreground pipelines are left to whoever's waiting for them.
+//
+// With job control, each pipeline gets a process group of its own, which has the
+// terminal while it's in the foreground, so Ctrl+C and Ctrl+Z go to it and not to us.
+//
+// Waiting never blocks on one process at a time: each one we're waiting for gets a
+// pidfd, which polls readable once it's exited, and the SIGCHLD pipe is polled along
+// with them for the ones that stop. That's what lets a wait give up at a deadline.
+
+static std::vector<Job> jobs; // Oldest first, so the last one is the current job
+static int wake_fds[2] = { -1, -1 };
+static bool controlling = false;
+static pid_t shell_pgid = 0;
+
+static void sig_chld_callback(int s) {
+    int saved_errno = errno;
+    char ch = 0;
+
+    write(wake_fds[1], &ch, 1);
+    errno = saved_errno;
+}
+
+// Sets up reaping, and job control too if we're running interactively on a terminal
+void init_jobs(bool interactive) {
+    if (pipe2(wake_fds, O_CLOEXEC | O_NONBLOCK) < 0)
+        perror("Error when creating pipe");
+
+    struct sigaction sig_chld_handler;
+    sig_chld_handler.sa_handler = sig_chld_callback;
+    sigemptyset(&sig_chld_handler.sa_mask);
+    sig_chld_handler.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sig_chld_handler, NULL);
+
+    if (!interactive || tcgetpgrp(STDIN_FILENO) < 0)
+        return;
+
+    // Wait until we've been put in the foreground, if we were started in the background
+    while (tcgetpgrp(STDIN_FILENO) != getpgrp())
+        kill(-getpgrp(), SIGTTIN);
+
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
+    setpgid(0, 0);
+    shell_pgid = getpgrp();
+    controlling = tcsetpgrp(STDIN_FILENO, shell_pgid) == 0;
+}
+
+// A builtin running in a child isn't the shell, so it leaves the terminal alone, and
+// gets a SIGCHLD pipe of its own for anything it runs. It can still look at the jobs
+// it inherited, but it's the shell that reaps them.
+void init_child_jobs() {
+    close(wake_fds[0]);
+    close(wake_fds[1]);
+
+    init_jobs(false);
+    controlling = false;
+}
+
+bool job_control() {
+    return controlling;
+}
+
+int job_wake_fd() {
+    return wake_fds[0];
+}
+
+// The exit status of a process the way the shell reports it, with 128 added to the
+// number of the signal that killed or stopped it
+int exit_code(int status) {
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    if (WIFSTOPPED(status))
+        return 128 + WSTOPSIG(status);
+
+    return WEXITSTATUS(status);
+}
+
+static std::vector<Job>::iterator find_id(int id) {
+    return std::find_if(jobs.begin(), jobs.end(), [id](const Job &job) { return job.id == id; });
+}
+
+static bool finished(const Job &job) {
+    return std::all_of(job.pids.begin(), job.pids.end(), [](pid_t pid) { return pid == -1; });
+}
+
+static void announce(const Job &job) {
+    if (!echo_input)
+        return;
+
+    if (job.stopped)
+        std::cout << std::endl << "\e[1m" << "Suspended [" << job.id << "] " << job.command << "\e[m" << std::endl;
+    else
+        std::cout << "[" << job.id << "] " << job.pids.back() << std::endl;
+}
+
+// Sets last_status and pipeline_status from the wait statuses of a pipeline's stages
+void record_statuses(const std::vector<int> &statuses) {
+    pipeline_status.clear();
+
+    for (int status : statuses)
+        pipeline_status.push_back(exit_code(status));
+
+    last_status = pipeline_status.back();
+}
+
+// Adds a pipeline to the job table, with the lowest id that isn't taken, and says so
+int add_job(pid_t pgid, const std::vector<pid_t> &pids, const std::vector<int> &statuses, const string &command, bool stopped) {
+    int id = 1;
+
+    while (find_id(id) != jobs.end())
+        ++id;
+
+    jobs.push_back({ id, pgid, pids, statuses, command, stopped });
+    announce(jobs.back());
+
+    return id;
+}
+
+// Finds a job from %n or n, or the current job when given nothing, % or %%
+const Job *find_job(const string &spec) {
+    if (spec.empty() || spec == "%" || spec == "%%")
+        return jobs.empty() ? nullptr : &jobs.back();
+
+    char *end;
+    long id = strtol(spec.c_str() + (spec[0] == '%'), &end, 10);
+
+    if (*end != '\0')
+        return nullptr;
+
+    auto job = find_id(id);
+
+    return job == jobs.end() ? nullptr : &*job;
+}
+
+const std::vector<Job> &job_list() {
+    return jobs;
+}
+
+// How many jobs haven't finished
+int job_count() {
+    return std::count_if(jobs.begin(), jobs.end(), [](const Job &job) { return !finished(job); });
+}
+
+void signal_group(pid_t pgid, const std::vector<pid_t> &pids, int sig) {
+    if (pgid > 0) {
+        kill(-pgid, sig);
+        return;
+    }
+
+    for (pid_t pid : pids) {
+        if (pid > 0)
+            kill(pid, sig);
+    }
+}
+
+// Collects whatever's finished, stopped or continued in the background, without blocking
+void reap_jobs() {
+    char buf[64];
+
+    while (read(wake_fds[0], buf, sizeof(buf)) > 0);
+
+    for (Job &job : jobs) {
+        for (size_t i = 0; i < job.pids.size(); ++i) {
+            int status;
+
+            while (job.pids[i] > 0) {
+                pid_t pid = waitpid(job.pids[i], &status, WNOHANG | WUNTRACED | WCONTINUED);
+
+                if (pid == 0 || (pid < 0 && errno == EINTR))
+                    break;
+
+                if (pid > 0 && WIFSTOPPED(status)) {
+                    job.stopped = true;
+                } else if (pid > 0 && WIFCONTINUED(status)) {
+                    job.stopped = false;
+                } else {
+                    job.statuses[i] = pid > 0 ? status : W_EXITCODE(EXIT_FAILURE, 0);
+                    job.pids[i] = -1;
+                }
+            }
+        }
+    }
+}
+
+// Says which jobs have finished, and forgets them
+void report_jobs() {
+    for (auto job = jobs.begin(); job != jobs.end();) {
+        if (!finished(*job)) {
+            ++job;
+            continue;
+        }
+
+        if (echo_input)
+            std::cout << "\e[1m" << "Done [" << job->id << "] " << job->command << "\e[m" << std::endl;
+
+        job = jobs.erase(job);
+    }
+}
+
+static int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int64_t now_ms() {
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// When a wait of this many milliseconds from now should give up, or -1 for never
+int64_t deadline_after(int ms) {
+    return ms < 0 ? -1 : now_ms() + ms;
+}
+
+// Waits for all of some processes to finish, or for one of them to stop, collecting
+// whichever finish as it goes, and saying what stopped it in stop_sig. Gives up at the
+// deadline if there is one, and when we're interrupted if interruptible is set.
+static WaitResult wait_pids(std::vector<pid_t> &pids, std::vector<int> &statuses, int64_t deadline, bool interruptible, int *stop_sig) {
+    std::vector<pollfd> fds;
+    std::vector<size_t> owners; // Which process each pidfd is for
+    bool watching_all = true;
+    WaitResult result = WAIT_DONE;
+    char buf[64];
+
+    fds.push_back({ wake_fds[0], POLLIN, 0 });
+
+    for (size_t i = 0; i < pids.size(); ++i) {
+        int fd = pids[i] > 0 ? open_pidfd(pids[i]) : -1;
+
+        if (fd >= 0) {
+            fds.push_back({ fd, POLLIN, 0 });
+            owners.push_back(i);
+        } else if (pids[i] > 0) {
+            watching_all = false;
+        }
+    }
+
+    for (;;) {
+        bool waiting = false;
+
+        while (read(wake_fds[0], buf, sizeof(buf)) > 0);
+
+        for (size_t i = 0; i < pids.size() && result == WAIT_DONE; ++i) {
+            int status;
+
+            if (pids[i] <= 0)
+                continue;
+
+            pid_t pid = waitpid(pids[i], &status, WNOHANG | WUNTRACED);
+
+            if (pid == 0 || (pid < 0 && errno == EINTR)) {
+                waiting = true;
+            } else if (pid > 0 && WIFSTOPPED(status)) {
+                statuses[i] = status;
+                *stop_sig = WSTOPSIG(status);
+                result = WAIT_STOPPED;
+            } else {
+                statuses[i] = pid > 0 ? status : W_EXITCODE(EXIT_FAILURE, 0);
+                pids[i] = -1;
+            }
+        }
+
+        // A pidfd stays readable once its process has exited, so stop watching it then
+        for (size_t i = fds.size() - 1; i > 0; --i) {
+            if (pids[owners[i - 1]] > 0)
+                continue;
+
+            close(fds[i].fd);
+            fds.erase(fds.begin() + i);
+            owners.erase(owners.begin() + i - 1);
+        }
+
+        if (result != WAIT_DONE || !waiting)
+            break;
+
+        if (interruptible && interrupted) {
+            result = WAIT_INTERRUPTED;
+            break;
+        }
+
+        int timeout = -1;
+
+        if (deadline >= 0) {
+            timeout = std::max<int64_t>(deadline - now_ms(), 0);
+
+            if (timeout == 0) {
+                result = WAIT_TIMEOUT;
+                break;
+            }
+        }
+
+        // Without a pidfd for everything, SIGCHLD is all there is to go on, so look again
+        // every so often in case it came before we were watching
+        if (!watching_all && (timeout < 0 || timeout > CHILD_POLL_MS))
+            timeout = CHILD_POLL_MS;
+
+        if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR)
+            break;
+    }
+
+    for (size_t i = 1; i < fds.size(); ++i)
+        close(fds[i].fd);
+
+    return result;
+}
+
+// Hands the terminal to a process group, or back to the shell given 0
+void give_terminal(pid_t pgid) {
+    if (controlling)
+        tcsetpgrp(STDIN_FILENO, pgid > 0 ? pgid : shell_pgid);
+}
+
+// Collects whatever's finished in a pipeline without waiting, and says whether any of
+// it has been stopped. One that went for the terminal before it had it goes on instead.
+bool check_stopped(pid_t pgid, std::vector<pid_t> &pids, std::vector<int> &statuses) {
+    int stop_sig;
+
+    if (wait_pids(pids, statuses, now_ms(), false, &stop_sig) != WAIT_STOPPED)
+        return false;
+
+    if (controlling && pgid > 0 && (stop_sig == SIGTTIN || stop_sig == SIGTTOU)) {
+        signal_group(pgid, pids, SIGCONT);
+        return false;
+    }
+
+    return true;
+}
+
+// Waits for the processes of a pipeline in the foreground, giving it the terminal in
+// the meantime, until they've all finished, one of them stops or the deadline passes
+WaitResult wait_foreground(pid_t pgid, std::vector<pid_t> &pids, std::vector<int> &statuses, int64_t deadline) {
+    WaitResult result;
+    int stop_sig;
+
+    if (controlling && pgid > 0)
+        tcsetpgrp(STDIN_FILENO, pgid);
+
+    for (;;) {
+        result = wait_pids(pids, statuses, deadline, false, &stop_sig);
+
+        // It went for the terminal before we'd handed it over, so it can go on now
+        if (result == WAIT_STOPPED && controlling && pgid > 0 && (stop_sig == SIGTTIN || stop_sig == SIGTTOU)) {
+            signal_group(pgid, pids, SIGCONT);
+            continue;
+        }
+
+        break;
+    }
+
+    if (controlling && pgid > 0)
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+
+    return result;
+}
+
+static volatile sig_atomic_t timed_pgid = 0;
+static const int forwarded_signals[] = { SIGINT, SIGTERM, SIGHUP, SIGTSTP };
+
+// Passes a signal on to the group of the command being timed, the way coreutils timeout
+// does, since it doesn't have the terminal to get it from. On Ctrl+Z we stop along
+// with it, and it's continued once we are.
+static void sig_forward_callback(int s) {
+    int saved_errno = errno;
+
+    kill(-timed_pgid, s);
+
+    if (s == SIGTSTP)
+        kill(getpid(), SIGSTOP);
+    else
+        kill(-timed_pgid, SIGCONT);
+
+    errno = saved_errno;
+}
+
+// Waits for a command running in a process group of its own, the way timeout runs it.
+// It can't be put aside, so it goes on if it's stopped, and once ms have passed its
+// group gets SIGTERM, then SIGKILL if it's still going a while after. Returns false if
+// it ran out of time.
+bool wait_timed(pid_t pid, int *status, int ms) {
+    std::vector<pid_t> pids = { pid };
+    std::vector<int> statuses = { W_EXITCODE(EXIT_FAILURE, 0) };
+    struct sigaction saved[std::size(forwarded_signals)];
+    bool forwarding = !controlling;
+
+    // With the terminal, it gets Ctrl+C and the rest itself
+    if (forwarding) {
+        struct sigaction sig_forward_handler;
+        sig_forward_handler.sa_handler = sig_forward_callback;
+        sigemptyset(&sig_forward_handler.sa_mask);
+        sig_forward_handler.sa_flags = SA_RESTART;
+
+        timed_pgid = pid;
+
+        for (size_t i = 0; i < std::size(forwarded_signals); ++i)
+            sigaction(forwarded_signals[i], &sig_forward_handler, &saved[i]);
+    }
+
+    auto wait_until = [&](int64_t deadline) {
+        WaitResult result;
+
+        while ((result = wait_foreground(pid, pids, statuses, deadline)) == WAIT_STOPPED) {
+            // Without the terminal, it can only wait for the deadline
+            if (WSTOPSIG(statuses[0]) != SIGTTIN && WSTOPSIG(statuses[0]) != SIGTTOU)
+                kill(-pid, SIGCONT);
+        }
+
+        return result;
+    };
+
+    bool finished = wait_until(deadline_after(ms)) == WAIT_DONE;
+
+    if (!finished) {
+        kill(-pid, SIGTERM);
+        kill(-pid, SIGCONT);
+
+        if (wait_until(deadline_after(TIMEOUT_KILL_MS)) != WAIT_DONE) {
+            kill(-pid, SIGKILL);
+            wait_until(-1);
+        }
+    }
+
+    if (forwarding) {
+        for (size_t i = 0; i < std::size(forwarded_signals); ++i)
+            sigaction(forwarded_signals[i], &saved[i], nullptr);
+    }
+
+    *status = statuses[0];
+
+    return finished;
+}
+
+// Continues a stopped job, or one in the background, either in the background or in
+// the foreground, waiting for it there
+void continue_job(int id, bool foreground) {
+    auto it = find_id(id);
+
+    if (it == jobs.end())
+        return;
+
+    if (!foreground) {
+        it->stopped = false;
+        signal_group(it->pgid, it->pids, SIGCONT);
+
+        if (echo_input)
+            std::cout << "[" << it->id << "] " << it->command << " &" << std::endl;
+
+        return;
+    }
+
+    // It's out of the table while it's in the foreground, and goes back in if it's stopped
+    Job job = std::move(*it);
+    jobs.erase(it);
+
+    if (echo_input)
+        std::cout << job.command << std::endl;
+
+    if (controlling && job.pgid > 0)
+        tcsetpgrp(STDIN_FILENO, job.pgid);
+
+    job.stopped = false;
+    signal_group(job.pgid, job.pids, SIGCONT);
+
+    if (wait_foreground(job.pgid, job.pids, job.statuses, -1) == WAIT_STOPPED) {
+        job.stopped = true;
+        jobs.push_back(std::move(job));
+        announce(jobs.back());
+        last_status = 128 + SIGTSTP;
+        return;
+    }
+
+    record_statuses(job.statuses);
+}
+
+// Waits for a job to finish in the background, or for all of them given 0. Stops
+// waiting on a job if it's stopped, and on all of them if we're interrupted.
+void wait_jobs(int id) {
+    for (auto it = jobs.begin(); it != jobs.end();) {
+        if (id != 0 && it->id != id) {
+            ++it;
+            continue;
+        }
+
+        if (!it->stopped) {
+            int stop_sig;
+            WaitResult result = wait_pids(it->pids, it->statuses, -1, true, &stop_sig);
+
+            if (result == WAIT_INTERRUPTED)
+                return;
+
+            it->stopped = result == WAIT_STOPPED;
+        }
+
+        if (!finished(*it)) {
+            ++it;
+            continue;
+        }
+
+        record_statuses(it->statuses);
+        it = jobs.erase(it);
+    }
+}
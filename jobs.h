@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+// A pipeline running in the background or stopped, which the shell still has to reap
+struct Job {
+    int id;
+    pid_t pgid;                 // 0 if its processes are in the shell's own group
+    std::vector<pid_t> pids;    // Each stage's process, or -1 once it's been reaped
+    std::vector<int> statuses;  // Each stage's wait status, once it's been reaped
+    std::string command;
+    bool stopped = false;
+};
+
+enum WaitResult {
+    WAIT_DONE,
+    WAIT_STOPPED,
+    WAIT_TIMEOUT,
+    WAIT_INTERRUPTED,
+};
+
+void init_jobs(bool);
+void init_child_jobs();
+bool job_control();
+int job_wake_fd();
+void reap_jobs();
+void report_jobs();
+int add_job(pid_t, const std::vector<pid_t>&, const std::vector<int>&, const std::string&, bool);
+const Job *find_job(const std::string&);
+const std::vector<Job> &job_list();
+int job_count();
+void signal_group(pid_t, const std::vector<pid_t>&, int);
+int64_t deadline_after(int);
+void give_terminal(pid_t);
+bool check_stopped(pid_t, std::vector<pid_t>&, std::vector<int>&);
+WaitResult wait_foreground(pid_t, std::vector<pid_t>&, std::vector<int>&, int64_t);
+bool wait_timed(pid_t, int*, int);
+void continue_job(int, bool);
+void wait_jobs(int);
+int exit_code(int);
+void record_statuses(const std::vector<int>&);
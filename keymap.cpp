@@ -0,0 +1,361 @@
+#include "keymap.h"
+
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+
+using std::string;
+
+// Keys resolve to editor actions through a trie of the bytes they send, built once
+// from the default bindings below and changed by bind. read_key hands over each key
+// whole, escape sequences included, and looking one up is a step per byte through
+// the trie, with nothing allocated.
+
+struct KeyNode {
+    uint16_t next[128] = {}; // The node for each byte that can follow, or 0 for none
+    Action action = ACTION_NONE;
+};
+
+static std::vector<KeyNode> nodes;
+
+// Named after what readline calls them
+static const char *action_names[ACTION_COUNT] = {
+    "none", "accept-line", "complete", "backward-delete-char", "delete-char",
+    "backward-char", "forward-char", "previous-history", "next-history",
+    "beginning-of-line", "end-of-line", "backward-word", "forward-word",
+    "backward-kill-word", "kill-word", "backward-kill-line", "kill-line",
+    "clear-screen", "reverse-search-history", "abort",
+};
+
+static const struct {
+    const char *key;
+    Action action;
+} default_bindings[] = {
+    { "enter",         ACTION_ACCEPT },
+    { "tab",           ACTION_COMPLETE },
+    { "backspace",     ACTION_BACKSPACE },
+    { "ctrl-h",        ACTION_BACKSPACE },
+    { "delete",        ACTION_DELETE },
+    { "ctrl-d",        ACTION_DELETE },
+    { "left",          ACTION_LEFT },
+    { "ctrl-b",        ACTION_LEFT },
+    { "right",         ACTION_RIGHT },
+    { "ctrl-f",        ACTION_RIGHT },
+    { "up",            ACTION_UP },
+    { "ctrl-p",        ACTION_UP },
+    { "down",          ACTION_DOWN },
+    { "ctrl-n",        ACTION_DOWN },
+    { "home",          ACTION_HOME },
+    { "ctrl-a",        ACTION_HOME },
+    { "end",           ACTION_END },
+    { "ctrl-e",        ACTION_END },
+    { "ctrl-left",     ACTION_WORD_LEFT },
+    { "alt-left",      ACTION_WORD_LEFT },
+    { "alt-b",         ACTION_WORD_LEFT },
+    { "ctrl-right",    ACTION_WORD_RIGHT },
+    { "alt-right",     ACTION_WORD_RIGHT },
+    { "alt-f",         ACTION_WORD_RIGHT },
+    { "ctrl-w",        ACTION_KILL_WORD_BEFORE },
+    { "alt-backspace", ACTION_KILL_WORD_BEFORE },
+    { "alt-d",         ACTION_KILL_WORD_AFTER },
+    { "ctrl-delete",   ACTION_KILL_WORD_AFTER },
+    { "ctrl-u",        ACTION_KILL_TO_START },
+    { "ctrl-k",        ACTION_KILL_TO_END },
+    { "ctrl-l",        ACTION_CLEAR_SCREEN },
+    { "ctrl-r",        ACTION_SEARCH },
+    { "ctrl-g",        ACTION_CANCEL },
+};
+
+// Keys that send escape sequences. Those with a letter send ESC [ letter (the arrows,
+// Home and End) or ESC O letter, and those with a number send ESC [ number ~. With
+// modifiers, they send ESC [ 1 ; modifiers letter or ESC [ number ; modifiers ~.
+static const struct {
+    const char *name;
+    char letter;
+    bool csi_letter;
+    int number;
+    int other_number; // What rxvt and the Linux console send instead, if it's different
+} special_keys[] = {
+    { "up",        'A', true,  0,  0 },
+    { "down",      'B', true,  0,  0 },
+    { "right",     'C', true,  0,  0 },
+    { "left",      'D', true,  0,  0 },
+    { "home",      'H', true,  1,  7 },
+    { "end",       'F', true,  4,  8 },
+    { "insert",    0,   false, 2,  0 },
+    { "delete",    0,   false, 3,  0 },
+    { "page-up",   0,   false, 5,  0 },
+    { "page-down", 0,   false, 6,  0 },
+    { "f1",        'P', false, 11, 0 },
+    { "f2",        'Q', false, 12, 0 },
+    { "f3",        'R', false, 13, 0 },
+    { "f4",        'S', false, 14, 0 },
+    { "f5",        0,   false, 15, 0 },
+    { "f6",        0,   false, 17, 0 },
+    { "f7",        0,   false, 18, 0 },
+    { "f8",        0,   false, 19, 0 },
+    { "f9",        0,   false, 20, 0 },
+    { "f10",       0,   false, 21, 0 },
+    { "f11",       0,   false, 23, 0 },
+    { "f12",       0,   false, 24, 0 },
+};
+
+// Keys that send a single character, besides the printable ones
+static const struct {
+    const char *name;
+    char ch;
+} named_chars[] = {
+    { "tab", '\t' }, { "enter", '\n' }, { "backspace", 0x7f }, { "escape", 0x1b }, { "space", ' ' },
+};
+
+void bind_key(std::string_view seq, Action action) {
+    size_t node = 0;
+
+    if (nodes.empty())
+        nodes.emplace_back();
+
+    for (unsigned char ch : seq) {
+        if (ch >= 128)
+            return;
+
+        if (nodes[node].next[ch] == 0) {
+            nodes[node].next[ch] = nodes.size();
+            nodes.emplace_back();
+        }
+
+        node = nodes[node].next[ch];
+    }
+
+    nodes[node].action = action;
+}
+
+Action lookup_key(std::string_view seq) {
+    size_t node = 0;
+
+    if (nodes.empty())
+        return ACTION_NONE;
+
+    for (unsigned char ch : seq) {
+        if (ch >= 128 || (node = nodes[node].next[ch]) == 0)
+            return ACTION_NONE;
+    }
+
+    return nodes[node].action;
+}
+
+void init_keymap() {
+    std::vector<string> seqs;
+
+    nodes.clear();
+    nodes.emplace_back();
+
+    for (const auto &binding : default_bindings) {
+        seqs.clear();
+        parse_key(binding.key, &seqs);
+
+        for (const string &seq : seqs)
+            bind_key(seq, binding.action);
+    }
+}
+
+// Reads a key written out the way it's sent, with \e for escape, \xHH, ^X for control
+// characters and so on
+static bool parse_raw_key(const string &spec, string *seq) {
+    for (size_t i = 0; i < spec.length(); ++i) {
+        if (spec[i] == '^' && i + 1 < spec.length()) {
+            char ch = toupper(spec[++i]);
+            *seq += ch == '?' ? (char) 0x7f : (char) (ch & 0x1f);
+        } else if (spec[i] == '\\' && i + 1 < spec.length()) {
+            switch (spec[++i]) {
+                case 'e': case 'E': *seq += '\e'; break;
+                case 't': *seq += '\t'; break;
+                case 'n': *seq += '\n'; break;
+                case 'r': *seq += '\r'; break;
+                case 'x': {
+                    string hex = spec.substr(i + 1, 2);
+                    char *end;
+                    long value = strtol(hex.c_str(), &end, 16);
+
+                    if (hex.empty() || *end != '\0')
+                        return false;
+
+                    *seq += (char) value;
+                    i += hex.length();
+                    break;
+                }
+                default: *seq += spec[i]; break;
+            }
+        } else {
+            *seq += spec[i];
+        }
+    }
+
+    return !seq->empty();
+}
+
+// Works out what a key sends from its name, like ctrl-a, alt-left, shift-tab or f5,
+// or from the sequence itself, like \e[1;5D. Some keys send different things in
+// different terminals, so there can be more than one.
+bool parse_key(const string &spec, std::vector<string> *seqs) {
+    if (spec.find('\\') != string::npos || (spec.length() >= 2 && spec[0] == '^')) {
+        string seq;
+
+        if (!parse_raw_key(spec, &seq))
+            return false;
+
+        seqs->push_back(seq);
+        return true;
+    }
+
+    bool ctrl = false;
+    bool alt = false;
+    bool shift = false;
+    string name = spec;
+
+    for (;;) {
+        if (name.length() > 5 && name.compare(0, 5, "ctrl-") == 0) {
+            ctrl = true;
+            name.erase(0, 5);
+        } else if (name.length() > 4 && name.compare(0, 4, "alt-") == 0) {
+            alt = true;
+            name.erase(0, 4);
+        } else if (name.length() > 6 && name.compare(0, 6, "shift-") == 0) {
+            shift = true;
+            name.erase(0, 6);
+        } else {
+            break;
+        }
+    }
+
+    if (name.length() > 1) {
+        for (char &ch : name)
+            ch = tolower(ch);
+    }
+
+    for (const auto &key : special_keys) {
+        if (name != key.name)
+            continue;
+
+        int mod = 1 + shift + alt * 2 + ctrl * 4;
+
+        if (mod == 1 || mod == 3) {
+            // Some terminals send Alt as ESC before the key's usual sequence
+            string prefix = mod == 3 ? "\e" : "";
+
+            if (key.letter) {
+                if (key.csi_letter)
+                    seqs->push_back(prefix + "\e[" + key.letter);
+
+                seqs->push_back(prefix + "\eO" + key.letter);
+            }
+
+            if (key.number)
+                seqs->push_back(prefix + "\e[" + std::to_string(key.number) + "~");
+            if (key.other_number)
+                seqs->push_back(prefix + "\e[" + std::to_string(key.other_number) + "~");
+        }
+
+        if (mod > 1) {
+            if (key.letter)
+                seqs->push_back("\e[1;" + std::to_string(mod) + key.letter);
+            if (key.number)
+                seqs->push_back("\e[" + std::to_string(key.number) + ";" + std::to_string(mod) + "~");
+        }
+
+        return true;
+    }
+
+    if (name == "tab" && shift && !ctrl) {
+        seqs->push_back(alt ? "\e\e[Z" : "\e[Z");
+        return true;
+    }
+
+    char ch = name.length() == 1 ? name[0] : 0;
+
+    for (const auto &named : named_chars) {
+        if (name == named.name)
+            ch = named.ch;
+    }
+
+    if (ch == 0 || (unsigned char) ch >= 128)
+        return false;
+
+    if (shift)
+        ch = toupper(ch);
+
+    if (ctrl) {
+        if (ch == ' ')
+            ch = 0;
+        else if (ch == '?')
+            ch = 0x7f;
+        else if (isalpha(ch) || (ch >= '@' && ch <= '_'))
+            ch = toupper(ch) & 0x1f;
+        else
+            return false;
+    }
+
+    seqs->push_back(alt ? string("\e") + ch : string(1, ch));
+
+    return true;
+}
+
+bool parse_action(const string &name, Action *action) {
+    for (int i = 0; i < ACTION_COUNT; ++i) {
+        if (name == action_names[i]) {
+            *action = (Action) i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+const char *action_name(Action action) {
+    return action_names[action];
+}
+
+// Writes a sequence out so it can be read, and given back to bind
+static string describe_key(const string &seq) {
+    string out;
+
+    for (unsigned char ch : seq) {
+        if (ch == 0x1b) {
+            out += "\\e";
+        } else if (ch < 0x20 || ch == 0x7f) {
+            out += '^';
+            out += ch ^ 0x40;
+        } else if (ch == '\\' || ch == '^') {
+            out += '\\';
+            out += ch;
+        } else {
+            out += ch;
+        }
+    }
+
+    return out;
+}
+
+static void collect_bindings(size_t node, string &seq, std::vector<std::pair<string, string>> &out) {
+    if (nodes[node].action != ACTION_NONE)
+        out.emplace_back(describe_key(seq), action_names[nodes[node].action]);
+
+    for (int ch = 0; ch < 128; ++ch) {
+        if (nodes[node].next[ch] == 0)
+            continue;
+
+        seq.push_back(ch);
+        collect_bindings(nodes[node].next[ch], seq, out);
+        seq.pop_back();
+    }
+}
+
+// Every bound key, and what it's bound to
+std::vector<std::pair<string, string>> list_bindings() {
+    std::vector<std::pair<string, string>> out;
+    string seq;
+
+    if (!nodes.empty())
+        collect_bindings(0, seq, out);
+
+    return out;
+}
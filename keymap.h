@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+enum Action {
+    ACTION_NONE,
+    ACTION_ACCEPT,
+    ACTION_COMPLETE,
+    ACTION_BACKSPACE,
+    ACTION_DELETE,
+    ACTION_LEFT,
+    ACTION_RIGHT,
+    ACTION_UP,
+    ACTION_DOWN,
+    ACTION_HOME,
+    ACTION_END,
+    ACTION_WORD_LEFT,
+    ACTION_WORD_RIGHT,
+    ACTION_KILL_WORD_BEFORE,
+    ACTION_KILL_WORD_AFTER,
+    ACTION_KILL_TO_START,
+    ACTION_KILL_TO_END,
+    ACTION_CLEAR_SCREEN,
+    ACTION_SEARCH,
+    ACTION_CANCEL,
+    ACTION_COUNT,
+};
+
+void init_keymap();
+Action lookup_key(std::string_view);
+bool parse_key(const std::string&, std::vector<std::string>*);
+bool parse_action(const std::string&, Action*);
+const char *action_name(Action);
+void bind_key(std::string_view, Action);
+std::vector<std::pair<std::string, std::string>> list_bindings();
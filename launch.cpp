@@ -0,0 +1,109 @@
+#include "config.h"
+#include "launch.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <spawn.h>
+#include <unistd.h>
+#include <vector>
+
+extern char **environ;
+
+// Signals the shell handles or ignores itself, which its children shouldn't
+static const int shell_signals[] = { SIGINT, SIGCHLD, SIGTSTP, SIGTTIN, SIGTTOU };
+
+// Sets up a forked child of the shell, putting it in process group pgid (0 for a new
+// one, -1 to stay in ours) and giving it the default signal handling
+void prepare_child(pid_t pgid) {
+    if (pgid >= 0)
+        setpgid(0, pgid);
+
+    for (int sig : shell_signals)
+        signal(sig, SIG_DFL);
+}
+
+// The old way of doing things, kept around for platforms where posix_spawn isn't usable
+static pid_t fork_launch(char **args, int fd_in, int fd_out, const std::vector<int> &fds_to_close, pid_t pgid) {
+    pid_t pid = fork();
+
+    if (pid != 0)
+        return pid;
+
+    prepare_child(pgid);
+
+    if (fd_in != -1)
+        dup2(fd_in, STDIN_FILENO);
+
+    if (fd_out != -1) {
+        dup2(fd_out, STDOUT_FILENO);
+        dup2(fd_out, STDERR_FILENO);
+    }
+
+    for (int fd : fds_to_close)
+        close(fd);
+
+    execv(args[0], args);
+    perror(args[0]);
+    _exit(EXIT_FAILURE);
+}
+
+// Launches an external command with fd_in as its stdin and fd_out as its stdout
+// and stderr (-1 inherits ours), closing fds_to_close in the child and putting it
+// in process group pgid the way prepare_child does. posix_spawn
+// lets libc use a vfork-style launch, so the cost doesn't grow with our own
+// memory footprint the way fork() does. Returns -1 and sets errno if the command
+// couldn't be started.
+pid_t launch_command(char **args, int fd_in, int fd_out, const std::vector<int> &fds_to_close, pid_t pgid) {
+#if USE_POSIX_SPAWN
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    short flags = POSIX_SPAWN_SETSIGDEF;
+    pid_t pid;
+    int err;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+
+    sigemptyset(&defaults);
+
+    for (int sig : shell_signals)
+        sigaddset(&defaults, sig);
+
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+
+    if (pgid >= 0) {
+        posix_spawnattr_setpgroup(&attr, pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+
+    posix_spawnattr_setflags(&attr, flags);
+
+    if (fd_in != -1)
+        posix_spawn_file_actions_adddup2(&actions, fd_in, STDIN_FILENO);
+
+    if (fd_out != -1) {
+        posix_spawn_file_actions_adddup2(&actions, fd_out, STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, fd_out, STDERR_FILENO);
+    }
+
+    for (int fd : fds_to_close)
+        posix_spawn_file_actions_addclose(&actions, fd);
+
+    err = posix_spawn(&pid, args[0], &actions, &attr, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (err == 0)
+        return pid;
+
+    if (err != ENOSYS) {
+        errno = err;
+        return -1;
+    }
+#endif
+
+    return fork_launch(args, fd_in, fd_out, fds_to_close, pgid);
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <sys/types.h>
+#include <vector>
+
+void prepare_child(pid_t);
+pid_t launch_command(char**, int, int, const std::vector<int>&, pid_t);
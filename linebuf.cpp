@@ -0,0 +1,313 @@
+#include "linebuf.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+using std::string;
+
+struct CodepointRange {
+    uint32_t first;
+    uint32_t last;
+};
+
+// Combining marks and other characters that take up no columns of their own
+static constexpr CodepointRange zero_width[] = {
+    { 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd }, { 0x0610, 0x061a },
+    { 0x064b, 0x065f }, { 0x0900, 0x0903 }, { 0x093a, 0x094f }, { 0x0e31, 0x0e31 },
+    { 0x0e34, 0x0e3a }, { 0x0e47, 0x0e4e }, { 0x1ab0, 0x1aff }, { 0x1dc0, 0x1dff },
+    { 0x200b, 0x200f }, { 0x202a, 0x202e }, { 0x2060, 0x2064 }, { 0x20d0, 0x20ff },
+    { 0xfe00, 0xfe0f }, { 0xfe20, 0xfe2f }, { 0xfeff, 0xfeff }, { 0x1f3fb, 0x1f3ff },
+    { 0xe0000, 0xe0fff },
+};
+
+// East Asian wide and fullwidth characters, and emoji, which take up two columns
+static constexpr CodepointRange double_width[] = {
+    { 0x1100, 0x115f }, { 0x231a, 0x231b }, { 0x23e9, 0x23ec }, { 0x25fd, 0x25fe },
+    { 0x2614, 0x2615 }, { 0x26aa, 0x26ab }, { 0x26bd, 0x26be }, { 0x26f5, 0x26f5 },
+    { 0x2705, 0x2705 }, { 0x270a, 0x270b }, { 0x274c, 0x274c }, { 0x2795, 0x2797 },
+    { 0x2b1b, 0x2b1c }, { 0x2e80, 0x303e }, { 0x3041, 0x33ff }, { 0x3400, 0x4dbf },
+    { 0x4e00, 0x9fff }, { 0xa000, 0xa4cf }, { 0xa960, 0xa97f }, { 0xac00, 0xd7a3 },
+    { 0xf900, 0xfaff }, { 0xfe10, 0xfe19 }, { 0xfe30, 0xfe6f }, { 0xff00, 0xff60 },
+    { 0xffe0, 0xffe6 }, { 0x16fe0, 0x16fe4 }, { 0x17000, 0x18cff }, { 0x1b000, 0x1b2ff },
+    { 0x1f004, 0x1f004 }, { 0x1f0cf, 0x1f0cf }, { 0x1f18e, 0x1f18e }, { 0x1f191, 0x1f19a },
+    { 0x1f200, 0x1f251 }, { 0x1f300, 0x1f64f }, { 0x1f680, 0x1f6ff }, { 0x1f7e0, 0x1f7eb },
+    { 0x1f90c, 0x1f9ff }, { 0x1fa70, 0x1faff }, { 0x20000, 0x2fffd }, { 0x30000, 0x3fffd },
+};
+
+static constexpr uint32_t ZWJ = 0x200d;
+
+template <size_t N>
+static bool in_ranges(const CodepointRange (&ranges)[N], uint32_t cp) {
+    auto it = std::upper_bound(std::begin(ranges), std::end(ranges), cp, [](uint32_t cp, const CodepointRange &range) {
+        return cp < range.first;
+    });
+
+    return it != std::begin(ranges) && cp <= (it - 1)->last;
+}
+
+// How many columns a code point takes up in the terminal
+int codepoint_width(uint32_t cp) {
+    if (cp < 0x300)
+        return 1;
+    if (in_ranges(zero_width, cp))
+        return 0;
+    if (in_ranges(double_width, cp))
+        return 2;
+
+    return 1;
+}
+
+static inline bool is_continuation(unsigned char byte) {
+    return (byte & 0xc0) == 0x80;
+}
+
+static inline size_t sequence_length(unsigned char lead) {
+    return (lead & 0xe0) == 0xc0 ? 2 : (lead & 0xf0) == 0xe0 ? 3 : (lead & 0xf8) == 0xf0 ? 4 : 1;
+}
+
+// Decodes the code point at pos, reading bytes through byte_at, and moves pos past
+// it. A malformed sequence is taken a byte at a time.
+template <typename ByteAt>
+static uint32_t decode(ByteAt byte_at, size_t &pos, size_t len) {
+    unsigned char lead = byte_at(pos);
+    size_t count = sequence_length(lead);
+    uint32_t cp = lead & (0x7f >> count);
+
+    if (count > 1 && pos + count <= len) {
+        for (size_t i = 1; i < count; ++i) {
+            unsigned char byte = byte_at(pos + i);
+
+            if (!is_continuation(byte)) {
+                count = 1;
+                break;
+            }
+
+            cp = cp << 6 | (byte & 0x3f);
+        }
+    } else {
+        count = 1;
+    }
+
+    pos += count;
+
+    return count == 1 ? lead : cp;
+}
+
+// How many columns a string takes up in the terminal. Whatever a zero width joiner
+// joins on is drawn as part of the character before it.
+int display_width(std::string_view str) {
+    auto byte_at = [&](size_t pos) { return (unsigned char) str[pos]; };
+    uint32_t prev = 0;
+    int width = 0;
+
+    for (size_t pos = 0; pos < str.length();) {
+        uint32_t cp = decode(byte_at, pos, str.length());
+
+        if (prev != ZWJ)
+            width += codepoint_width(cp);
+
+        prev = cp;
+    }
+
+    return width;
+}
+
+// Where the grapheme starting at pos ends: past the code point there and any that
+// combine with it or are joined on to it
+size_t grapheme_end(std::string_view str, size_t pos) {
+    auto byte_at = [&](size_t pos) { return (unsigned char) str[pos]; };
+    uint32_t prev = decode(byte_at, pos, str.length());
+
+    while (pos < str.length()) {
+        size_t next = pos;
+        uint32_t cp = decode(byte_at, next, str.length());
+
+        if (codepoint_width(cp) != 0 && prev != ZWJ)
+            break;
+
+        prev = cp;
+        pos = next;
+    }
+
+    return pos;
+}
+
+unsigned char LineBuffer::byte_at(size_t pos) const {
+    return buf[pos < gap_start ? pos : pos + (gap_end - gap_start)];
+}
+
+uint32_t LineBuffer::codepoint_at(size_t pos) const {
+    return decode([this](size_t pos) { return byte_at(pos); }, pos, length());
+}
+
+size_t LineBuffer::codepoint_after(size_t pos) const {
+    decode([this](size_t pos) { return byte_at(pos); }, pos, length());
+    return pos;
+}
+
+size_t LineBuffer::codepoint_before(size_t pos) const {
+    size_t start = pos;
+
+    // Back over up to three continuation bytes to the byte that leads them
+    while (start > 0 && pos - start < 4) {
+        --start;
+
+        if (!is_continuation(byte_at(start)))
+            break;
+    }
+
+    return codepoint_after(start) == pos ? start : pos - 1;
+}
+
+// Whether the code point at pos belongs with the grapheme before it: it's a combining
+// mark or the like, or it follows a zero width joiner
+bool LineBuffer::extends(size_t pos) const {
+    return pos > 0 && (codepoint_width(codepoint_at(pos)) == 0 || codepoint_at(codepoint_before(pos)) == ZWJ);
+}
+
+size_t LineBuffer::grapheme_before(size_t pos) const {
+    do {
+        pos = codepoint_before(pos);
+    } while (extends(pos));
+
+    return pos;
+}
+
+size_t LineBuffer::grapheme_after(size_t pos) const {
+    do {
+        pos = codepoint_after(pos);
+    } while (pos < length() && extends(pos));
+
+    return pos;
+}
+
+// Where the word the cursor is in or after starts, skipping any spaces first
+size_t LineBuffer::word_before(size_t pos) const {
+    while (pos > 0 && byte_at(pos - 1) == ' ')
+        --pos;
+    while (pos > 0 && byte_at(pos - 1) != ' ')
+        pos = grapheme_before(pos);
+
+    return pos;
+}
+
+// Where the word the cursor is in or before ends, skipping any spaces first
+size_t LineBuffer::word_after(size_t pos) const {
+    while (pos < length() && byte_at(pos) == ' ')
+        ++pos;
+    while (pos < length() && byte_at(pos) != ' ')
+        pos = grapheme_after(pos);
+
+    return pos;
+}
+
+// Moves the gap so that it starts at pos, shifting only the bytes in between
+void LineBuffer::move_gap(size_t pos) {
+    if (pos < gap_start) {
+        size_t count = gap_start - pos;
+        memmove(buf.data() + gap_end - count, buf.data() + pos, count);
+        gap_start -= count;
+        gap_end -= count;
+    } else if (pos > gap_start) {
+        size_t count = pos - gap_start;
+        memmove(buf.data() + gap_start, buf.data() + gap_end, count);
+        gap_start += count;
+        gap_end += count;
+    }
+}
+
+string LineBuffer::str() const {
+    return before() + after();
+}
+
+string LineBuffer::before() const {
+    return string(buf.data(), gap_start);
+}
+
+string LineBuffer::after() const {
+    return string(buf.data() + gap_end, buf.size() - gap_end);
+}
+
+// Replaces the whole line, leaving the cursor at the end
+void LineBuffer::assign(std::string_view text) {
+    clear();
+    insert(text);
+}
+
+void LineBuffer::clear() {
+    gap_start = 0;
+    gap_end = buf.size();
+}
+
+void LineBuffer::insert(std::string_view text) {
+    // Growing the gap geometrically keeps inserts amortized O(1) per byte
+    if (gap_end - gap_start < text.length()) {
+        size_t tail = buf.size() - gap_end;
+        size_t size = std::max(buf.size() * 2, length() + text.length() + 64);
+        std::vector<char> grown(size);
+
+        memcpy(grown.data(), buf.data(), gap_start);
+        memcpy(grown.data() + size - tail, buf.data() + gap_end, tail);
+
+        buf = std::move(grown);
+        gap_end = size - tail;
+    }
+
+    memcpy(buf.data() + gap_start, text.data(), text.length());
+    gap_start += text.length();
+}
+
+// Deletes the grapheme before the cursor
+void LineBuffer::erase_before() {
+    if (gap_start > 0)
+        gap_start = grapheme_before(gap_start);
+}
+
+// Deletes the grapheme after the cursor
+void LineBuffer::erase_after() {
+    if (gap_start < length())
+        gap_end += grapheme_after(gap_start) - gap_start;
+}
+
+void LineBuffer::erase_word_before() {
+    gap_start = word_before(gap_start);
+}
+
+void LineBuffer::erase_word_after() {
+    gap_end += word_after(gap_start) - gap_start;
+}
+
+void LineBuffer::erase_to_start() {
+    gap_start = 0;
+}
+
+void LineBuffer::erase_to_end() {
+    gap_end = buf.size();
+}
+
+void LineBuffer::move_left() {
+    if (gap_start > 0)
+        move_gap(grapheme_before(gap_start));
+}
+
+void LineBuffer::move_right() {
+    if (gap_start < length())
+        move_gap(grapheme_after(gap_start));
+}
+
+void LineBuffer::move_home() {
+    move_gap(0);
+}
+
+void LineBuffer::move_end() {
+    move_gap(length());
+}
+
+void LineBuffer::move_word_left() {
+    move_gap(word_before(gap_start));
+}
+
+void LineBuffer::move_word_right() {
+    move_gap(word_after(gap_start));
+}
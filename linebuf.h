@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+int codepoint_width(uint32_t);
+int display_width(std::string_view);
+size_t grapheme_end(std::string_view, size_t);
+
+// A gap buffer holding the line being edited. The text before the cursor sits at the
+// start of the storage and the text after it at the end, with the gap in between, so
+// typing and deleting at the cursor never shift the rest of the line. The cursor only
+// ever stops between graphemes.
+class LineBuffer {
+public:
+    bool empty() const { return length() == 0; }
+    size_t length() const { return buf.size() - (gap_end - gap_start); }
+    size_t cursor() const { return gap_start; }
+
+    std::string str() const;
+    std::string before() const;
+    std::string after() const;
+
+    void assign(std::string_view);
+    void clear();
+    void insert(std::string_view);
+    void erase_before();
+    void erase_after();
+    void erase_word_before();
+    void erase_word_after();
+    void erase_to_start();
+    void erase_to_end();
+
+    void move_left();
+    void move_right();
+    void move_home();
+    void move_end();
+    void move_word_left();
+    void move_word_right();
+
+private:
+    std::vector<char> buf;
+    size_t gap_start = 0;
+    size_t gap_end = 0;
+
+    unsigned char byte_at(size_t) const;
+    uint32_t codepoint_at(size_t) const;
+    size_t codepoint_before(size_t) const;
+    size_t codepoint_after(size_t) const;
+    bool extends(size_t) const;
+    size_t grapheme_before(size_t) const;
+    size_t grapheme_after(size_t) const;
+    size_t word_before(size_t) const;
+    size_t word_after(size_t) const;
+    void move_gap(size_t);
+};
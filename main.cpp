@@ -1,24 +1,34 @@
 #include "builtins.h"
+#include "complete.h"
+#include "history.h"
+#include "input.h"
+#include "jobs.h"
+#include "keymap.h"
+#include "linebuf.h"
 #include "config.h"
 #include "control.h"
 #include "global.h"
+#include "launch.h"
+#include "paths.h"
+#include "render.h"
+#include "snapshot.h"
 #include "utils.h"
 
 #include <algorithm>
 #include <csignal>
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <fcntl.h>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <limits.h>
 #include <map>
-#include <pwd.h>
-#include <regex>
+#include <poll.h>
 #include <string>
-#include <sys/ioctl.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -28,62 +38,54 @@
 using std::string;
 
 void select_completions(int);
-void print_completions(int);
 void initialize_path();
-void load_path();
 void load_prompt();
 void load_rc();
-void process_keypress(char);
-void files_in_dir(string);
 void execute_script(string);
 void suggest(int);
 void cmd_enter(string);
 void cmd_launch(std::vector<Command>, bool);
-int cmd_execute(int, char**, bool, bool);
-bool process_esc_seq();
+void run_pipeline(const std::vector<std::vector<string>>&, bool, bool);
+const string *expand_command(Command, bool, std::vector<string>&);
+void apply_effects(const Effects&);
 string parse_path_file(string);
 
-char c;
 unsigned int last_status = 0;
 unsigned int history_idx = 0;
 int completion_idx = -1;
-int input_idx = INSERT_END;
+int search_idx = -1;
 bool echo_input  = true;
-bool in_esc_seq  = false;
 bool skip_next   = false;
-bool pipe_input  = false;
-bool pipe_output = false;
 bool or_output   = false;
 bool and_output  = false;
 bool bg_command  = false;
 bool with_var    = false;
 bool suggesting  = false;
-bool getch_skip  = false;
 bool subcommand  = false;
 bool completing  = false;
-int pipefd_input[2];
-int pipefd_output[2];
-int pipefd_subc[2];
-char subc_buf[1024];
+bool completion_partial = false;
+bool searching   = false;
+bool search_failed = false;
+bool split_output  = false;
+volatile sig_atomic_t interrupted = 0;
 
 std::map<string, string> executable_map;
 std::map<string, string> alias_map;
-std::map<string, int (*)(int, char**, unsigned int*, char*, char*)> builtins_map;
+std::map<string, builtin_fn> builtins_map;
 std::map<string, string> set_globals;
 std::vector<string> unset_globals;
-std::vector<string> history;
 std::vector<string> matches;
-std::vector<pid_t> suspended_pids;
-string esc_seq;
-string cmd_str;
+std::vector<int> pipeline_status;
+LineBuffer cmd_buf;
 string prompt;
 string subc_out;
+string completion_path;
+string search_query;
+string search_saved;
 string arg;
 string prev_dir;
 pid_t pid = 0;
-pid_t active_pid = 0;
-pid_t last_pid = 0;
-pid_t suspended_pid = 0;
+pid_t shell_pid = 0;
 
 NullStream null;
 
@@ -95,23 +97,16 @@ inline std::ostream& serr() {
     return echo_input ? std::cerr : null;
 }
 
-void files_in_dir(string path) {
-    struct stat info;
-
-    if (dir_exists(path.c_str())) {
-        for (const auto & entry : std::filesystem::directory_iterator(path))
-            executable_map.emplace(entry.path().filename(), entry.path());
-    } else {
-        serr() << path << " is not a valid directory" << std::endl;
-    }
-}
-
 void execute_script(string filename) {
     echo_input = false;
     std::fstream fin(filename, std::fstream::in);
+    string line;
 
-    while (fin >> std::noskipws >> c)
-        process_keypress(c);
+    while (std::getline(fin, line)) {
+        observe_line_start();
+        cmd_enter(line);
+        observe_line_end(line);
+    }
 
     echo_input = true;
 }
@@ -168,406 +163,801 @@ void initialize_path() {
     setenv("PATH", path.c_str(), true);
 }
 
-void load_path() {
-    executable_map.clear();
-
-    const char* c_path = std::getenv("PATH");
-    string path(c_path ?: "");
-    path += ':';
-
-    size_t pos = 0;
-    string dir;
-    while ((pos = path.find(':')) != string::npos) {
-        dir = path.substr(0, pos);
-        files_in_dir(dir);
-        path.erase(0, pos + 1);
-    }
-}
-
 void load_prompt() {
     const char* raw_prompt_c = std::getenv("WSH_PROMPT");
     string raw_prompt(raw_prompt_c ?: DEFAULT_PROMPT);
-    prompt = escape_string(raw_prompt);
+    prompt = render_prompt(raw_prompt);
 }
 
-void load_rc() {
+string rc_path() {
     string local_path(".");
     local_path += '/';
     local_path += RC_FILENAME;
 
-    if (file_exists(local_path)) {
-        execute_script(local_path);
-        return;
-    }
+    if (file_exists(local_path))
+        return local_path;
 
-    struct passwd *pw = getpwuid(getuid());
-    string home_path(pw->pw_dir);
+    string home_path(home_dir());
     home_path += '/';
     home_path += RC_FILENAME;
 
-    if (file_exists(home_path)) {
-        execute_script(home_path);
+    if (file_exists(home_path))
+        return home_path;
+
+    return "";
+}
+
+void load_rc() {
+    string path = rc_path();
+
+    std::vector<string> rerun;
+
+    // A snapshot of an earlier run of the same rc file saves us from running most of it again
+    if (load_snapshot(path, rerun)) {
+        echo_input = false;
+
+        for (const string &line : rerun)
+            cmd_enter(line);
+
+        echo_input = true;
         return;
     }
+
+    load_path(); // This reads the PATH variable to determine full paths to commands
+
+    begin_snapshot(path);
+
+    if (!path.empty())
+        execute_script(path);
+
+    load_path(); // The rc file could have edited PATH, so catch up on any directories it added
+    end_snapshot();
 }
 
-void load_history() {
-    struct passwd *pw = getpwuid(getuid());
-    string history_path(pw->pw_dir);
-    history_path += '/';
-    history_path += HIST_FILENAME;
+void apply_effects(const Effects &effects) {
+    const char *arg_a = effects.arg_a.c_str();
+    const char *arg_b = effects.arg_b.c_str();
+
+    if (effects.flags & FLAG_EXIT)
+        exit(last_status);
+
+    if (effects.flags & FLAG_CD) {
+        std::filesystem::current_path(arg_a);
+        prev_dir = effects.arg_b;
+        invalidate_current_dir();
+    }
+
+    if (effects.flags & FLAG_SKIP)
+        skip_next = true;
+
+    if (effects.flags & FLAG_SILENCE)
+        echo_input = effects.arg_a == "1";
+
+    if (effects.flags & FLAG_SPLIT)
+        split_output = effects.arg_a == "1";
+
+    if (effects.flags & FLAG_SET)
+        setenv(arg_a, arg_b, true);
+
+    if (effects.flags & FLAG_UNSET)
+        unsetenv(arg_a);
+
+    if (effects.flags & FLAG_RELOAD) {
+        load_path(true);
+        load_prompt();
+    }
+
+    if (effects.flags & FLAG_BIND) {
+        std::vector<string> seqs;
+        Action action;
+
+        if (parse_key(effects.arg_a, &seqs) && parse_action(effects.arg_b, &action)) {
+            for (const string &seq : seqs)
+                bind_key(seq, action);
+        }
+    }
+
+    if (effects.flags & FLAG_ALIAS) {
+        if (effects.arg_b.empty())
+            alias_map.erase(effects.arg_a);
+        else
+            alias_map.emplace(effects.arg_a, effects.arg_b);
+    }
+
+    if (effects.flags & FLAG_WITH_S) {
+        set_globals[effects.arg_a] = string(std::getenv(arg_a));
+        setenv(arg_a, arg_b, true);
+        with_var = true;
+    }
+
+    if (effects.flags & FLAG_WITH_U) {
+        unset_globals.push_back(effects.arg_a);
+        setenv(arg_a, arg_b, true);
+        with_var = true;
+    }
+
+    if (effects.flags & FLAG_WITHOUT) {
+        for (auto it = set_globals.begin(); it != set_globals.end(); ++it) {
+            setenv(it->first.c_str(), it->second.c_str(), true);
+        }
+
+        for (string name : unset_globals) {
+            unsetenv(name.c_str());
+        }
+
+        set_globals.clear();
+        unset_globals.clear();
+    }
+
+    if (effects.flags & FLAG_RESUME)
+        continue_job(atoi(arg_a), true);
+
+    if (effects.flags & FLAG_BG)
+        continue_job(atoi(arg_a), false);
+
+    if (effects.flags & FLAG_WAIT)
+        wait_jobs(atoi(arg_a));
+
+    if (effects.flags & FLAG_KILL) {
+        const Job *job = arg_a[0] == '%' ? find_job(effects.arg_a) : nullptr;
+
+        if (job) {
+            signal_group(job->pgid, job->pids, SIGTERM);
+
+            // A stopped job has to be woken up to die
+            if (job->stopped)
+                signal_group(job->pgid, job->pids, SIGCONT);
+        } else {
+            kill(atoi(arg_a), SIGTERM);
+        }
+    }
 
-    if (file_exists(history_path)) {
-        string str;
-        std::fstream fin(history_path, std::fstream::in);
+    if (effects.flags & FLAG_RUN) {
+        cmd_enter(string("wsh ") + effects.arg_a);
+    }
 
-        while (getline(fin, str))
-            history.push_back(str);
+    if (effects.flags & FLAG_SOURCE) {
+        bool echo_before = echo_input;
+        echo_input = false;
+        execute_script(effects.arg_a);
+        echo_input = echo_before;
     }
+
+    // Only rescans directories that were added to PATH, and only if it changed
+    if (effects.flags & (FLAG_SET | FLAG_UNSET | FLAG_WITH_S | FLAG_WITH_U | FLAG_WITHOUT))
+        load_path();
 }
 
-void save_history() {
-    struct passwd *pw = getpwuid(getuid());
-    string history_path(pw->pw_dir);
-    history_path += '/';
-    history_path += HIST_FILENAME;
+// Effects are sent as the flags followed by two length-prefixed strings
+void write_effects(int fd, const Effects &effects) {
+    string buf;
+    size_t len;
 
-    std::ofstream fout(history_path);
+    buf.append((const char*) &effects.flags, sizeof(effects.flags));
 
-    for (auto it = history.begin(); it != history.end(); ++it) {
-        fout << *it << std::endl;
+    for (const string *str : { &effects.arg_a, &effects.arg_b }) {
+        len = str->length();
+        buf.append((const char*) &len, sizeof(len));
+        buf += *str;
+    }
+
+    const char *p = buf.data();
+    size_t left = buf.length();
+
+    while (left > 0) {
+        ssize_t nwritten = write(fd, p, left);
+
+        if (nwritten < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        p += nwritten;
+        left -= nwritten;
     }
 }
 
-int cmd_execute(int argc, char **args, bool is_subcommand, bool is_background) {
-    pid_t wpid;
-    int status;
-    with_var = false;
+void suggest(int direction) {
+    if (history_size() == 0)
+        return;
+
+    // Only change history_idx if we are already suggesting
+    if (suggesting) {
+        if (direction == DIRECTION_UP && history_idx < history_size() - 1)
+            ++history_idx;
+        if (direction == DIRECTION_DOWN && history_idx > 0)
+            --history_idx;
+    }
+
+    cmd_buf.assign(history_at(history_idx));
+    suggesting = true;
+}
+
+char** vec_to_charptr(std::vector<string> vec_tokens) {
+    // Now we have to translate our vector into a nullptr-terminated char**
+    char** tokens = (char**) malloc((vec_tokens.size() + 1) * sizeof(char*));
+    if (!tokens) {
+        perror("Error when allocating arguments buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < vec_tokens.size(); ++i) {
+        string arg = vec_tokens[i];
+
+        tokens[i] = (char*) malloc((arg.length() + 1) * sizeof(char));
+        if (!tokens[i]) {
+            perror("Error when allocating argument buffer");
+            exit(EXIT_FAILURE);
+        }
 
-    if (pipe_input || pipe_output) {
-        int tmp_a = pipefd_input[0], tmp_b = pipefd_input[1];
+        strcpy(tokens[i], arg.c_str());
+    }
+
+    tokens[vec_tokens.size()] = nullptr;
+
+    // This fixes some weird behavior with `which` for some reason
+    sout().flush();
+
+    return tokens;
+}
+
+bool parse_effects(const string &buf, Effects *effects) {
+    size_t pos = 0;
+    size_t len;
+
+    if (buf.length() < sizeof(effects->flags))
+        return false;
+
+    memcpy(&effects->flags, buf.data(), sizeof(effects->flags));
+    pos += sizeof(effects->flags);
+
+    for (string *str : { &effects->arg_a, &effects->arg_b }) {
+        if (buf.length() - pos < sizeof(len))
+            return false;
+
+        memcpy(&len, buf.data() + pos, sizeof(len));
+        pos += sizeof(len);
+
+        if (buf.length() - pos < len)
+            return false;
+
+        str->assign(buf, pos, len);
+        pos += len;
+    }
+
+    return true;
+}
+
+// Reads each fd into the end of the string paired with it until they've all reached
+// end of file, then closes them. They're read as data arrives on any of them, so a
+// child blocked writing to one can't hold up the others. Reads go straight into the
+// strings, which grow geometrically, so big outputs aren't copied through a buffer.
+// Whenever wake_fd is readable, woken is called, and it can give up on the rest by
+// returning false.
+void drain_fds(const std::vector<std::pair<int, string*>> &fds, int wake_fd, const std::function<bool()> &woken) {
+    std::vector<struct pollfd> pfds;
+    std::vector<size_t> used;
+    size_t open = fds.size();
+
+    for (const auto &[fd, buf] : fds) {
+        pfds.push_back({ fd, POLLIN, 0 });
+        used.push_back(buf->length());
+    }
+
+    pfds.push_back({ wake_fd, POLLIN, 0 });
+
+    while (open > 0) {
+        if (poll(pfds.data(), pfds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (pfds.back().revents != 0 && !woken())
+            break;
+
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (pfds[i].fd < 0 || pfds[i].revents == 0)
+                continue;
+
+            string &buf = *fds[i].second;
+
+            if (buf.length() - used[i] < CAPTURE_READ_SIZE)
+                buf.resize(std::max(buf.length() * 2, used[i] + CAPTURE_READ_SIZE));
+
+            ssize_t nread = read(pfds[i].fd, buf.data() + used[i], buf.length() - used[i]);
+
+            if (nread > 0) {
+                used[i] += nread;
+            } else if (nread == 0 || errno != EINTR) {
+                close(pfds[i].fd);
+                pfds[i].fd = -1;
+                --open;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < fds.size(); ++i) {
+        if (pfds[i].fd >= 0)
+            close(pfds[i].fd);
+
+        fds[i].second->resize(used[i]);
+    }
+}
+
+// Starts one stage of a pipeline with fd_in as its stdin and fd_out as its stdout and
+// stderr (-1 keeps ours), closing fds_to_close in the child and putting it in process
+// group pgid (0 for a new one, -1 for ours). A builtin runs in a fork of the shell and
+// hands its effects back through the pipe left in *effects_fd. Without effects_fd,
+// nobody is going to read them, and a builtin that has some fails instead.
+pid_t spawn_stage(int argc, char **args, int fd_in, int fd_out, const std::vector<int> &fds_to_close, pid_t pgid, int *effects_fd) {
+    auto builtin = builtins_map.find(args[0]);
+    int pipefd_effects[2] = { -1, -1 };
+    pid_t pid;
+
+    if (effects_fd != nullptr)
+        *effects_fd = -1;
 
-        pipefd_input[READ_END] = pipefd_output[READ_END];
-        pipefd_input[WRITE_END] = pipefd_output[WRITE_END];
+    if (builtin == builtins_map.end()) {
+        pid = launch_command(args, fd_in, fd_out, fds_to_close, pgid);
 
-        pipefd_output[READ_END] = tmp_a;
-        pipefd_output[WRITE_END] = tmp_b;
+        if (pid < 0)
+            perror(args[0]);
+        else if (pgid >= 0)
+            setpgid(pid, pgid == 0 ? pid : pgid); // In case we get to it before the child does
+
+        return pid;
     }
 
-    auto flags = (unsigned int*) mmap(NULL, sizeof(unsigned int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    auto flag_arg_a = (char*) mmap(NULL, sizeof(char) * 1024, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    auto flag_arg_b = (char*) mmap(NULL, sizeof(char) * 1024, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (effects_fd != nullptr && pipe2(pipefd_effects, O_CLOEXEC) < 0) {
+        perror("Error when creating pipe");
+        return -1;
+    }
 
     pid = fork();
 
     if (pid == 0) {
         // Child process
+        prepare_child(pgid);
+        init_child_jobs();
 
-        if (pipe_input) {
-            close(pipefd_input[WRITE_END]);
+        if (fd_in != -1)
+            dup2(fd_in, STDIN_FILENO);
 
-            // Send pipe to stdin
-            dup2(pipefd_input[READ_END], STDIN_FILENO);
+        if (fd_out != -1) {
+            dup2(fd_out, STDOUT_FILENO);
+            dup2(fd_out, STDERR_FILENO);
         }
 
-        if (pipe_output) {
-            close(pipefd_output[READ_END]);
+        for (int fd : fds_to_close)
+            close(fd);
+
+        if (pipefd_effects[READ_END] != -1)
+            close(pipefd_effects[READ_END]);
 
-            // Send stdout and stderr to pipe
-            dup2(pipefd_output[WRITE_END], STDOUT_FILENO);
-            dup2(pipefd_output[WRITE_END], STDERR_FILENO);
-        } else if (is_subcommand) {
-            close(pipefd_subc[READ_END]);
+        Effects effects;
+        int result = builtin->second(argc, args, &effects);
 
-            // Send stdout and stderr to subcommand pipe
-            dup2(pipefd_subc[WRITE_END], STDOUT_FILENO);
-            dup2(pipefd_subc[WRITE_END], STDERR_FILENO);
+        // Nothing's sent without effects, in case nobody's reading any more
+        if (effects.flags != 0 && pipefd_effects[WRITE_END] != -1) {
+            write_effects(pipefd_effects[WRITE_END], effects);
+            close(pipefd_effects[WRITE_END]);
+        } else if (effects.flags != 0) {
+            std::cerr << args[0] << " can't change the shell from the background!" << std::endl;
+            result = CODE_FAIL;
         }
 
-        // Find if this is a builtin command
-        auto it = builtins_map.find(args[0]);
-        if (it != builtins_map.end()) {
-            auto builtin_fn = it->second;
-            int result = builtin_fn(argc, args, flags, flag_arg_a, flag_arg_b);
+        exit(result);
+    }
 
-            exit(result);
-        } else {
-            if (execv(args[0], args) == -1) {
-                // We would update some sort of status here or something
-                perror(args[0]);
-            }
+    if (pipefd_effects[WRITE_END] != -1)
+        close(pipefd_effects[WRITE_END]);
 
-            exit(EXIT_FAILURE);
-        }
-    } else if (pid < 0) {
+    if (pid < 0) {
         perror("Error when forking child process");
-    } else {
-        // Parent process
 
-        active_pid = pid;
+        if (pipefd_effects[READ_END] != -1)
+            close(pipefd_effects[READ_END]);
 
-        if (!is_background) {
-            // We want to run waitpid before checking the conditions, hence the do {} while
-            do {
-                wpid = waitpid(pid, &status, WUNTRACED);
-            } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+        return -1;
+    }
 
-            last_status = WEXITSTATUS(status);
-            last_pid = active_pid;
-            active_pid = 0;
+    if (pgid >= 0)
+        setpgid(pid, pgid == 0 ? pid : pgid);
 
-            // Check for flags set by child process
-            if (*flags & FLAG_EXIT)
-                exit(last_status);
+    if (effects_fd != nullptr)
+        *effects_fd = pipefd_effects[READ_END];
 
-            if (*flags & FLAG_CD) {
-                std::filesystem::current_path(flag_arg_a);
-                prev_dir = string(flag_arg_b);
-            }
+    return pid;
+}
 
-            if (*flags & FLAG_SKIP)
-                skip_next = true;
+// A pipeline that's been started, and what's left to collect from it once it's done
+struct Pipeline {
+    pid_t pgid = 0;          // The process group it's in, with job control
+    std::vector<pid_t> pids; // Each stage's process, or -1 once it's been reaped
+    std::vector<int> statuses;
+    std::vector<int> effects_fds;
+    std::vector<string> effects_bufs;
+    int capture = -1; // Where the last stage's output comes out, for a subcommand
+    string output;
+    string command;   // What to call it in the job table
+    bool background = false; // Started with &, so nothing reads its builtins' effects
+};
+
+// Starts a pipeline with every stage running at once, each connected to the next by a
+// pipe of its own, so a stage can write as much as it likes. With capture set, the last
+// stage's output is collected when the pipeline is finished. With job control, it goes
+// in the process group pipeline.pgid, or a new one if that's 0.
+void start_pipeline(const std::vector<std::vector<string>> &stages, bool capture, Pipeline &pipeline) {
+    size_t count = stages.size();
+    int pipefd_capture[2] = { -1, -1 };
+    int fd_in = -1;
+
+    pipeline.pids.assign(count, -1);
+    pipeline.statuses.assign(count, W_EXITCODE(EXIT_FAILURE, 0));
+    pipeline.effects_fds.assign(count, -1);
+    pipeline.effects_bufs.assign(count, "");
+
+    if (capture) {
+        if (pipe2(pipefd_capture, O_CLOEXEC) < 0)
+            perror("Error when creating pipe");
+
+#ifdef F_SETPIPE_SZ
+        // A bigger pipe means fewer trips between the writer and us for big outputs
+        if (pipefd_capture[READ_END] != -1)
+            fcntl(pipefd_capture[READ_END], F_SETPIPE_SZ, CAPTURE_PIPE_SIZE);
+#endif
+    }
 
-            if (*flags & FLAG_SILENCE)
-                echo_input = *flag_arg_a;
+    sout().flush();
 
-            if (*flags & FLAG_SET)
-                setenv(flag_arg_a, flag_arg_b, true);
+    for (size_t i = 0; i < count; ++i) {
+        int next[2] = { -1, -1 };
+        int fd_out = pipefd_capture[WRITE_END];
+        std::vector<int> fds_to_close;
 
-            if (*flags & FLAG_UNSET)
-                unsetenv(flag_arg_a);
+        if (i + 1 < count) {
+            if (pipe2(next, O_CLOEXEC) < 0)
+                perror("Error when creating pipe");
 
-            if (*flags & FLAG_RELOAD) {
-                load_path();
-                load_prompt();
-            }
+            fd_out = next[WRITE_END];
+        }
 
-            if (*flags & FLAG_ALIAS) {
-                if (*flag_arg_b == '\0')
-                    alias_map.erase(string(flag_arg_a));
-                else
-                    alias_map.emplace(string(flag_arg_a), string(flag_arg_b));
-            }
+        // The stage gets its own ends as stdin and stdout, and none of the others
+        for (int fd : { fd_in, fd_out, next[READ_END], pipefd_capture[READ_END] }) {
+            if (fd != -1)
+                fds_to_close.push_back(fd);
+        }
 
-            if (*flags & FLAG_WITH_S) {
-                set_globals[string(flag_arg_a)] = string(std::getenv(flag_arg_a));
-                setenv(flag_arg_a, flag_arg_b, true);
-                with_var = true;
-            }
+        char **args = vec_to_charptr(stages[i]);
+        pid_t pgid = job_control() ? pipeline.pgid : -1;
 
-            if (*flags & FLAG_WITH_U) {
-                unset_globals.push_back(string(flag_arg_a));
-                setenv(flag_arg_a, flag_arg_b, true);
-                with_var = true;
-            }
+        observe_command(stages[i].size(), args, builtins_map.count(args[0]), capture);
+        int *effects_fd = pipeline.background ? nullptr : &pipeline.effects_fds[i];
+        pipeline.pids[i] = spawn_stage(stages[i].size(), args, fd_in, fd_out, fds_to_close, pgid, effects_fd);
 
-            if (*flags & FLAG_WITHOUT) {
-                for (auto it = set_globals.begin(); it != set_globals.end(); ++it) {
-                    setenv(it->first.c_str(), it->second.c_str(), true);
-                }
+        if (pipeline.pids[i] > 0) {
+            pipeline.statuses[i] = 0;
 
-                for (string name : unset_globals) {
-                    unsetenv(name.c_str());
-                }
+            // The first stage that starts leads the group
+            if (pgid == 0)
+                pipeline.pgid = pipeline.pids[i];
+        }
 
-                set_globals.clear();
-                unset_globals.clear();
-            }
+        pipeline.command += (i > 0 ? " | " : "") + std::filesystem::path(stages[i][0]).filename().string();
 
-            if (*flags & FLAG_RESUME) {
-                kill(suspended_pid, SIGCONT);
-                active_pid = suspended_pid;
+        for (size_t j = 1; j < stages[i].size(); ++j)
+            pipeline.command += " " + stages[i][j];
 
-                do {
-                    wpid = waitpid(active_pid, &status, WUNTRACED);
-                } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+        // Only the stages should hold the write ends, so that each one sees end of
+        // file when the stage before it is done
+        if (fd_in != -1)
+            close(fd_in);
+        if (next[WRITE_END] != -1)
+            close(next[WRITE_END]);
 
-                last_status = WEXITSTATUS(status);
-                last_pid = active_pid;
-                active_pid = 0;
-            }
+        fd_in = next[READ_END];
+    }
 
-            if (*flags & FLAG_KILL) {
-                pid_t this_pid = atoi(flag_arg_a);
-                int idx = atoi(flag_arg_b);
+    if (pipefd_capture[WRITE_END] != -1)
+        close(pipefd_capture[WRITE_END]);
 
-                kill(this_pid, SIGTERM);
+    pipeline.capture = pipefd_capture[READ_END];
+}
 
-                if (idx != -1)
-                    suspended_pids[idx] = -1;
-            }
+// Waits for pipelines to finish, collecting what they write as they write it, then
+// applies their effects in order. Each stage's exit status goes in pipeline_status and
+// the last stage's in last_status, so the last pipeline's are what's left there.
+void finish_pipelines(std::vector<Pipeline> &pipelines) {
+    std::vector<std::pair<int, string*>> outputs;
 
-            if (*flags & FLAG_RUN) {
-                string cmd = "wsh ";
-                cmd += flag_arg_a;
-                cmd_enter(string("wsh ") + flag_arg_a);
-            }
+    for (Pipeline &pipeline : pipelines) {
+        if (pipeline.capture != -1)
+            outputs.emplace_back(pipeline.capture, &pipeline.output);
 
-            if (*flags & FLAG_SOURCE) {
-                bool echo_before = echo_input;
-                echo_input = false;
-                execute_script(string(flag_arg_a));
-                echo_input = echo_before;
-            }
+        for (size_t i = 0; i < pipeline.pids.size(); ++i) {
+            if (pipeline.effects_fds[i] != -1)
+                outputs.emplace_back(pipeline.effects_fds[i], &pipeline.effects_bufs[i]);
+        }
+    }
 
-            munmap(flags, sizeof(unsigned int));
-            munmap(flag_arg_a, sizeof(char) * 1024);
-            munmap(flag_arg_b, sizeof(char) * 1024);
+    std::vector<bool> stopped(pipelines.size());
 
-            if (pipe_input) {
-                close(pipefd_input[READ_END]);
-                pipe(pipefd_input);
-            }
+    // They have the terminal while they're writing, so Ctrl+C and Ctrl+Z reach them
+    if (!pipelines.empty())
+        give_terminal(pipelines.front().pgid);
 
-            if (pipe_output) {
-                close(pipefd_output[WRITE_END]);
-            } else if (is_subcommand) {
-                close(pipefd_subc[WRITE_END]);
+    // Drain before waiting so a large output or effect can't wedge a child, keeping an
+    // eye out for any of them being stopped, which would otherwise leave us waiting
+    drain_fds(outputs, job_wake_fd(), [&]() {
+        for (size_t i = 0; i < pipelines.size(); ++i) {
+            Pipeline &pipeline = pipelines[i];
 
-                subc_out.clear();
+            if (!check_stopped(pipeline.pgid, pipeline.pids, pipeline.statuses))
+                continue;
 
-                while (int nread = read(pipefd_subc[READ_END], subc_buf, 1023)) {
-                    subc_buf[nread] = '\0';
-                    subc_out += subc_buf;
-                }
+            if (pipeline.capture != -1)
+                signal_group(pipeline.pgid, pipeline.pids, SIGCONT);
+            else
+                stopped[i] = true;
+        }
+
+        return std::find(stopped.begin(), stopped.end(), true) == stopped.end();
+    });
 
-                // Trailing newlines break lots of things with subcommands
-                if (subc_out.back() == '\n')
-                    subc_out.pop_back();
+    for (size_t i = 0; i < pipelines.size(); ++i) {
+        Pipeline &pipeline = pipelines[i];
 
-                close(pipefd_subc[READ_END]);
-                pipe(pipefd_subc);
+        while (stopped[i] || wait_foreground(pipeline.pgid, pipeline.pids, pipeline.statuses, -1) == WAIT_STOPPED) {
+            // A subcommand's output is needed to go on, so it can't be put aside
+            if (pipeline.capture != -1) {
+                signal_group(pipeline.pgid, pipeline.pids, SIGCONT);
+                continue;
             }
 
-            pipe_input = pipe_output;
-            pipe_output = false;
+            // If it was stopped before we got to waiting on it, we still need the terminal back
+            give_terminal(0);
+            add_job(pipeline.pgid, pipeline.pids, pipeline.statuses, pipeline.command, true);
+            stopped[i] = true;
+            break;
         }
-    }
 
-    return 1;
+        record_statuses(pipeline.statuses);
+
+        if (stopped[i])
+            last_status = 128 + SIGTSTP;
+
+        // Apply effects requested by forked builtins
+        for (const string &buf : pipeline.effects_bufs) {
+            Effects effects;
+
+            if (parse_effects(buf, &effects))
+                apply_effects(effects);
+        }
+
+        // Trailing newlines break lots of things with subcommands
+        if (!pipeline.output.empty() && pipeline.output.back() == '\n')
+            pipeline.output.pop_back();
+    }
 }
 
-void suggest(int direction) {
-    if (history.empty())
+// Runs a pipeline and waits for it, unless it's in the background. For a subcommand,
+// the last stage's output ends up in subc_out.
+void run_pipeline(const std::vector<std::vector<string>> &stages, bool is_subcommand, bool is_background) {
+    std::vector<Pipeline> pipelines(1);
+    Pipeline &pipeline = pipelines[0];
+
+    with_var = false;
+
+    // A builtin on its own that isn't feeding a subcommand runs right here, no fork needed
+    auto builtin = builtins_map.find(stages[0][0]);
+
+    if (stages.size() == 1 && !is_subcommand && builtin != builtins_map.end()) {
+        char **args = vec_to_charptr(stages[0]);
+        Effects effects;
+
+        observe_command(stages[0].size(), args, true, false);
+
+        last_status = builtin->second(stages[0].size(), args, &effects);
+        pipeline_status.assign(1, last_status);
+        std::cout.flush();
+        std::cerr.flush();
+
+        apply_effects(effects);
+
         return;
+    }
 
-    // Only change history_idx if we are already suggesting
-    if (suggesting) {
-        if (direction == DIRECTION_UP && history_idx < history.size() - 1)
-            ++history_idx;
-        if (direction == DIRECTION_DOWN && history_idx > 0)
-            --history_idx;
+    // Nothing waits on a background pipeline to apply what its builtins do
+    pipeline.background = is_background;
+    start_pipeline(stages, is_subcommand, pipeline);
+
+    if (is_background) {
+        if (pipeline.capture != -1)
+            close(pipeline.capture);
+
+        // It's reaped once it's finished, through the job table
+        if (std::any_of(pipeline.pids.begin(), pipeline.pids.end(), [](pid_t pid) { return pid > 0; }))
+            add_job(pipeline.pgid, pipeline.pids, pipeline.statuses, pipeline.command, false);
+
+        return;
     }
 
-    string suggestion = history.at(history_idx);
+    finish_pipelines(pipelines);
+
+    if (is_subcommand)
+        subc_out = std::move(pipeline.output);
+}
+
+// Strips the quotes from a piece of an argument, expanding it unless they're single quotes
+string expand_literal(const string &val) {
+    if (val.length() >= 2 && val.front() == '\'' && val.back() == '\'')
+        return val.substr(1, val.length() - 2);
+
+    // Replace variables and expand tildes
+    if (val.length() >= 2 && val.front() == '\"' && val.back() == '\"')
+        return expand_string(val.substr(1, val.length() - 2), EXPAND_ALL);
+
+    return expand_string(val, EXPAND_ALL);
+}
+
+// Expands a subcommand that's a single pipeline of external commands into its stages,
+// so that it can be started alongside others. Anything else, aliases and builtins
+// included, has to go through cmd_launch, and nothing is run to find that out.
+bool expand_pipeline(const std::vector<Command> &commands, std::vector<std::vector<string>> &stages) {
+    if (commands.empty())
+        return false;
+
+    for (size_t c = 0; c < commands.size(); ++c) {
+        const Command &cmd = commands[c];
+
+        if (cmd.and_output || cmd.or_output || cmd.bg_command || cmd.pipe_output != (c + 1 < commands.size()))
+            return false;
+
+        const Argument &word = cmd.args[0];
+
+        if (word.size() != 1 || !std::holds_alternative<string>(word[0]))
+            return false;
 
-    // Move back to right after the prompt, then clear the line and print our suggestion
-    if (!cmd_str.empty()) {
-        sout() << "\e[" << cmd_str.length() << "D"
-               << "\e[K";
+        string name = expand_literal(std::get<string>(word[0]));
+
+        // A builtin can change what the subcommands after it expand to
+        if (alias_map.count(name) || builtins_map.count(name))
+            return false;
     }
 
-    cmd_str = suggestion;
-    sout() << cmd_str;
+    for (const Command &cmd : commands)
+        expand_command(cmd, false, stages.emplace_back());
 
-    suggesting = true;
+    return true;
 }
 
-bool process_esc_seq() {
-    std::smatch match;
+// Runs the subcommands in the arguments from first to last, adding their output to
+// outputs in order. Runs of single pipelines of external commands are started before
+// any of them is waited on, so a few slow ones take as long as the slowest rather than
+// the sum. Any other subcommand waits for those before it, and runs on its own, so
+// the ones after it are only expanded once its effects are in place.
+void run_substitutions(std::vector<Argument>::const_iterator first, std::vector<Argument>::const_iterator last, std::vector<string> &outputs) {
+    std::vector<Pipeline> pipelines;
+    std::vector<size_t> started; // Where each pipeline's output goes in outputs
 
-    if (std::regex_match(esc_seq, match, std::regex("\\[([ABCD])"))) {
-        if (completing) {
-            if (match[1] == "A") { // UP
-                select_completions(DIRECTION_UP);
-                print_completions(completion_idx);
-            } else if (match[1] == "B") { // DOWN
-                select_completions(DIRECTION_DOWN);
-                print_completions(completion_idx);
-            } else if (match[1] == "C") { // RIGHT
-                select_completions(DIRECTION_RIGHT);
-                print_completions(completion_idx);
-            } else if (match[1] == "D") { // LEFT
-                select_completions(DIRECTION_LEFT);
-                print_completions(completion_idx);
-            }
-        } else {
-            if (match[1] == "A") { // UP
-                suggest(DIRECTION_UP);
-            } else if (match[1] == "B") { // DOWN
-                suggest(DIRECTION_DOWN);
-            } else if (match[1] == "C") { // RIGHT
-                if (input_idx != INSERT_END) {
-                    if (++input_idx > cmd_str.length() - 1)
-                        input_idx = INSERT_END;
+    auto finish_started = [&]() {
+        if (pipelines.empty())
+            return;
 
-                    sout() << "\e[C";
-                }
-            } else if (match[1] == "D") { // LEFT
-                if (input_idx != 0)
-                    sout() << "\e[D";
-
-                if (input_idx == INSERT_END)
-                    input_idx = cmd_str.length() - 1;
-                else if (input_idx > 0)
-                    --input_idx;
-            }
-        }
+        finish_pipelines(pipelines);
 
-        return true;
-    } else if (std::regex_match(esc_seq, match, std::regex("\\[(?:(\\d)~|(H))"))) {
-        if (match[1] == "1" || match[1] == "7" || match[1] == "H") {
-            if (input_idx > 0) {
-                sout() << "\e[" << input_idx << "D";
-                input_idx = 0;
-            } else if (input_idx == INSERT_END && !cmd_str.empty()) {
-                sout() << "\e[" << cmd_str.length() << "D";
-                input_idx = 0;
-            }
-        } else if (match[1] == "3") {
-            std::cout << "DELETE" << std::endl;
-        } else if (match[1] == "4" || match[1] == "8") {
-            if (input_idx != INSERT_END) {
-                sout() << "\e[" << (cmd_str.length() - input_idx) << "C";
-                input_idx = INSERT_END;
+        for (size_t i = 0; i < pipelines.size(); ++i)
+            outputs[started[i]] = std::move(pipelines[i].output);
+
+        pipelines.clear();
+        started.clear();
+    };
+
+    for (auto it = first; it != last; ++it) {
+        for (const auto &component : *it) {
+            if (!std::holds_alternative<CommandList>(component))
+                continue;
+
+            const std::vector<Command> &commands = std::get<CommandList>(component);
+            std::vector<std::vector<string>> stages;
+
+            if (expand_pipeline(commands, stages)) {
+                // They share a process group, so they can all have the terminal at once
+                pid_t pgid = pipelines.empty() ? 0 : pipelines.front().pgid;
+
+                pipelines.emplace_back().pgid = pgid;
+                start_pipeline(stages, true, pipelines.back());
+                started.push_back(outputs.size());
+                outputs.emplace_back();
+            } else {
+                finish_started();
+                subc_out.clear();
+                cmd_launch(commands, true);
+                outputs.push_back(std::move(subc_out));
             }
         }
-
-        return true;
     }
 
-    return false;
+    finish_started();
 }
 
-char** vec_to_charptr(std::vector<string> vec_tokens) {
-    // Now we have to translate our vector into a nullptr-terminated char**
-    char** tokens = (char**) malloc((vec_tokens.size() + 1) * sizeof(char*));
-    if (!tokens) {
-        perror("Error when allocating arguments buffer");
-        exit(EXIT_FAILURE);
+// Expands a command's arguments into args, running the subcommands in them. If the
+// command word turns out to be an alias and check_alias is set, it stops there and
+// returns what the alias stands for.
+const string *expand_command(Command cmd, bool check_alias, std::vector<string> &args) {
+    std::vector<string> outputs;
+    size_t next_output = 0;
+
+    for (int i = 0; i < cmd.args.size(); ++i) {
+        Argument arg = cmd.args[i];
+        std::vector<Argument> new_args = expand_argument(arg);
+
+        if (!new_args.empty()) {
+            cmd.args.erase(cmd.args.begin() + i);
+
+            for (int j = 0; j < new_args.size(); ++j) {
+                cmd.args.insert(cmd.args.begin() + i + j, new_args[j]);
+            }
+        }
     }
 
-    for (int i = 0; i < vec_tokens.size(); ++i) {
-        string arg = vec_tokens[i];
+    for (int i = 0; i < cmd.args.size(); ++i) {
+        const Argument &arg = cmd.args[i];
+        string arg_str;
+
+        // The command word comes first on its own, as the rest isn't run for an alias
+        if (i == 0)
+            run_substitutions(cmd.args.begin(), cmd.args.begin() + 1, outputs);
+        else if (i == 1)
+            run_substitutions(cmd.args.begin() + 1, cmd.args.end(), outputs);
+
+        for (const auto &arg_component : arg) {
+            if (std::holds_alternative<string>(arg_component)) {
+                arg_str += expand_literal(std::get<string>(arg_component));
+            } else if (arg_str.empty()) {
+                arg_str.swap(outputs[next_output++]);
+            } else {
+                arg_str += outputs[next_output++];
+            }
+        }
 
-        tokens[i] = (char*) malloc((arg.length() + 1) * sizeof(char));
-        if (!tokens[i]) {
-            perror("Error when allocating argument buffer");
-            exit(EXIT_FAILURE);
+        // After split true, an argument that's only a subcommand becomes an argument
+        // for each word of its output, read straight out of the captured buffer
+        if (split_output && i > 0 && arg.size() == 1 && std::holds_alternative<CommandList>(arg[0])) {
+            split_words(arg_str, args);
+            continue;
         }
 
-        strcpy(tokens[i], arg.c_str());
-    }
+        // If we are looking at the command itself...
+        if (i == 0) {
+            // and the command has an alias...
+            if (check_alias) {
+                auto alias = alias_map.find(arg_str);
+                if (alias != alias_map.end())
+                    return &alias->second;
+            }
 
-    tokens[vec_tokens.size()] = nullptr;
+            // and the command isn't a builtin...
+            if (builtins_map.find(arg_str) == builtins_map.end()) {
+                // and it's on PATH...
+                auto executable = executable_map.find(arg_str);
+                if (executable != executable_map.end()) {
+                    // expand it to its full path
+                    arg_str = executable->second;
+                }
+            }
+        }
 
-    // This fixes some weird behavior with `which` for some reason
-    sout().flush();
+        args.push_back(std::move(arg_str));
+    }
 
-    return tokens;
+    return nullptr;
 }
 
 void cmd_launch(std::vector<Command> commands, bool is_subcommand) {
+    std::vector<std::vector<string>> stages;
     bool aliased = false;
 
     int c = 0;
@@ -575,108 +965,59 @@ void cmd_launch(std::vector<Command> commands, bool is_subcommand) {
         Command cmd = commands[c];
         std::vector<string> args;
 
-        if (skip_next) {
+        if (skip_next && stages.empty()) {
+            // Skipping a pipeline skips every stage of it
+            while (c < commands.size() && commands[c].pipe_output)
+                ++c;
+
             skip_next = false;
             ++c;
             continue;
         }
 
-        for (int i = 0; i < cmd.args.size(); ++i) {
-            Argument arg = cmd.args[i];
-            std::vector<Argument> new_args = expand_argument(arg);
-
-            if (!new_args.empty()) {
-                cmd.args.erase(cmd.args.begin() + i);
-
-                for (int j = 0; j < new_args.size(); ++j) {
-                    cmd.args.insert(cmd.args.begin() + i + j, new_args[j]);
-                }
-            }
-        }
-
-        for (int i = 0; i < cmd.args.size(); ++i) {
-            Argument arg = cmd.args[i];
-            string arg_str;
-
-            for (auto arg_component : arg) {
-                if (std::holds_alternative<string>(arg_component)) {
-                    string val = std::get<string>(arg_component);
-
-                    // Replace variables and expand tildes
-                    if (val.length() >= 2 && val.front() == '\'' && val.back() == '\'') {
-                        val = val.substr(1, val.length() - 2);
-                    } else if (val.length() >= 2 && val.front() == '\"' && val.back() == '\"') {
-                        val = val.substr(1, val.length() - 2);
-                        val = replace_variables(val);
-                        val = escape_string(val);
-                    } else {
-                        val = replace_variables(val);
-                        val = escape_string(val);
-                    }
-
-                    arg_str += val;
-                } else {
-                    cmd_launch(std::get<CommandList>(arg_component), true);
-                    arg_str += subc_out;
-                }
-            }
-
-            // If we are looking at the command itself...
-            if (i == 0) {
-                // and the command has an alias...
+        // An alias isn't looked up again in what it stands for
+        const string *alias = expand_command(cmd, !aliased, args);
+        aliased = alias != nullptr;
 
-                if (aliased) {
-                    aliased = false;
-                } else {
-                    auto alias = alias_map.find(arg_str);
-                    if (alias != alias_map.end()) {
-                        // Substitute the alias
-                        arg_str = alias->second;
+        if (alias) {
+            // Tokenize the alias
+            std::vector<Command> alias_tokens = tokenize(*alias);
 
-                        // Tokenize the alias
-                        std::vector<Command> alias_tokens = tokenize(arg_str);
+            // Erase the current command
+            commands.erase(commands.begin() + c);
 
-                        // Erase the current command
-                        commands.erase(commands.begin() + c);
+            // Replace it with the new alias
+            for (int j = 0; j < alias_tokens.size(); ++j) {
+                Command ncmd = alias_tokens[j];
 
-                        // Replace it with the new alias
-                        for (int j = 0; j < alias_tokens.size(); ++j) {
-                            Command ncmd = alias_tokens[j];
+                if (j == alias_tokens.size() - 1) {
+                    if (cmd.args.size() > 1)
+                        ncmd.args.insert(ncmd.args.end(), cmd.args.begin() + 1, cmd.args.end());
 
-                            if (j == alias_tokens.size() - 1 && cmd.args.size() > 1)
-                                ncmd.args.insert(ncmd.args.end(), cmd.args.begin() + 1, cmd.args.end());
-
-                            commands.insert(commands.begin() + c + j, ncmd);
-                        }
-
-                        aliased = true;
-                        break;
-                    }
+                    // and whatever joined it to the next command
+                    ncmd.pipe_output |= cmd.pipe_output;
+                    ncmd.and_output |= cmd.and_output;
+                    ncmd.or_output |= cmd.or_output;
+                    ncmd.bg_command |= cmd.bg_command;
                 }
 
-                // and the command isn't a builtin...
-                if (builtins_map.find(arg_str) == builtins_map.end()) {
-                    // and it's on PATH...
-                    auto executable = executable_map.find(arg_str);
-                    if (executable != executable_map.end()) {
-                        // expand it to its full path
-                        arg_str = executable->second;
-                    }
-                }
+                commands.insert(commands.begin() + c + j, ncmd);
             }
 
-            args.push_back(arg_str);
+            continue;
         }
 
-        if (cmd.pipe_output)
-            pipe_output = true;
+        stages.push_back(std::move(args));
 
-        if (aliased)
+        // Gather up the rest of the pipeline before starting any of it
+        if (cmd.pipe_output) {
+            ++c;
             continue;
+        }
 
         bool needs_without = with_var;
-        char **tokens = vec_to_charptr(args);
-        cmd_execute(args.size(), tokens, is_subcommand, cmd.bg_command);
+        run_pipeline(stages, is_subcommand, cmd.bg_command);
+        stages.clear();
         needs_without &= !with_var;
 
         if (needs_without)
@@ -694,6 +1035,10 @@ void cmd_launch(std::vector<Command> commands, bool is_subcommand) {
 
         ++c;
     }
+
+    // A line can end with a pipe
+    if (!stages.empty())
+        run_pipeline(stages, is_subcommand, false);
 }
 
 void cmd_enter(string input) {
@@ -709,43 +1054,24 @@ void cmd_enter(string input) {
 
     std::vector<Command> commands = tokenize(input);
 
-    cmd_launch(commands, false);
-}
-
-void print_completions(int index) {
-    struct winsize size;
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &size);
-
-    int row, col;
-    int chars_per_col = size.ws_col / COMPLETION_COLUMNS - 1;
-    int rows_added = matches.size() / COMPLETION_COLUMNS + 1;
-
-    get_cursor_pos(&row, &col); // Save our cursor position
-
-    sout() << "\e[J"     // Clear the rest of the screen
-           << std::endl;
+    // Pick up any executables that appeared or disappeared since the last command
+    refresh_path();
 
-    for (int i = 0; i < matches.size(); ++i) {
-        if (i > 0 && i % COMPLETION_COLUMNS == 0)
-            sout() << std::endl;
+    // Commands get the terminal the way they'd expect it, not the way the line editor has it
+    bool was_raw = raw_mode_off();
+    render_lost_cursor();
 
-        string entry = matches[i];
+    cmd_launch(commands, false);
 
-        if (entry.length() < chars_per_col)
-            entry.append(chars_per_col - entry.length(), ' ');
+    // Anything that finished in the background in the meantime
+    reap_jobs();
+    report_jobs();
 
-        if (i == index)
-            sout() << "\e[7m"  // Invert the characters
-                   << entry.substr(0, chars_per_col)
-                   << "\e[m "; // Return to normal
-        else
-            sout() << entry.substr(0, chars_per_col) << " ";
-    }
+    if (was_raw)
+        raw_mode_on();
 
-    if (row + rows_added > size.ws_row)
-        row = size.ws_row - rows_added;
-
-    sout() << "\e[" << row << ";" << col << "H"; // Move back to our saved cursor position
+    // Ctrl+C while a command ran was meant for the command
+    interrupted = 0;
 }
 
 void select_completions(int direction) {
@@ -776,6 +1102,8 @@ void cmd_complete(string input) {
 
     std::vector<Command> commands = tokenize(input);
 
+    refresh_path();
+
     if (commands.empty())
         return;
 
@@ -790,10 +1118,12 @@ void cmd_complete(string input) {
 
     if (last_command.args.size() == 1) {
         // Suggesting a command
-        matches = filter_prefix(executable_map, arg);
+        matches = command_completions(arg);
+        completion_partial = false;
     } else {
         // Suggesting an argument
-        matches = complete_path(replace_variables(arg));
+        completion_path = replace_variables(arg);
+        matches = complete_path(completion_path, &completion_partial);
     }
 
     if (completing) {
@@ -802,150 +1132,372 @@ void cmd_complete(string input) {
         completing = true;
         completion_idx = -1;
     }
+}
+
+// Called as more of a directory listing arrives while its completions are on screen
+void refresh_completions() {
+    if (!completing || !completion_partial)
+        return;
+
+    string selected;
 
-    print_completions(completion_idx);
+    if (completion_idx > -1 && completion_idx < (int) matches.size())
+        selected = matches[completion_idx];
+
+    matches = complete_path(completion_path, &completion_partial);
+
+    // Keep the same entry selected even though the list has grown around it
+    if (!selected.empty()) {
+        auto it = std::find(matches.begin(), matches.end(), selected);
+        completion_idx = it == matches.end() ? -1 : it - matches.begin();
+    }
+}
+
+// Draws the line editor as it should look now. Keys only change what's in it, and
+// this catches the screen up once they've all been handled.
+void draw_editor() {
+    if (!echo_input)
+        return;
+
+    Frame frame;
+
+    if (searching) {
+        frame.prompt = search_failed ? "(failed reverse-i-search)`" : "(reverse-i-search)`";
+        frame.prompt += search_query + "': ";
+        frame.line = search_idx == -1 ? "" : history_at(search_idx);
+        frame.cursor = frame.line.length();
+    } else {
+        frame.prompt = prompt.substr(prompt.rfind('\n') + 1); // Lines before the last are already out
+        frame.line = cmd_buf.str();
+        frame.cursor = cmd_buf.cursor();
+
+        if (completing) {
+            frame.menu = &matches;
+            frame.selected = completion_idx;
+        }
+    }
+
+    render_frame(frame);
 }
 
-void process_keypress(char ch) {
-    if (in_esc_seq) {
-        // Add our newest character
-        esc_seq += ch;
+// Leaves the command line on screen as it is, without the menu, and moves below it
+void leave_line() {
+    if (!echo_input)
+        return;
+
+    completing = false;
+    draw_editor();
+    render_newline();
+}
+
+// Prints all but the last line of the prompt, which is drawn with the command line
+void new_prompt() {
+    load_prompt();
+
+    if (!echo_input)
+        return;
+
+    render_start();
+    sout() << prompt.substr(0, prompt.rfind('\n') + 1);
+}
+
+// Blocks until there's a key to read, drawing the editor again whenever the terminal
+// is resized or more of a directory listing shows up for the completion menu, and
+// reaping background jobs as they finish
+void wait_for_input() {
+    while (!input_pending() && !interrupted) {
+        struct pollfd fds[3] = {
+            { STDIN_FILENO, POLLIN, 0 },
+            { job_wake_fd(), POLLIN, 0 },
+            { completion_wake_fd(), POLLIN, 0 },
+        };
+
+        draw_editor();
+
+        if (poll(fds, completing && completion_partial ? 3 : 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+
+            return;
+        }
+
+        if (fds[0].revents != 0)
+            return;
 
-        // If the sequence is complete...
-        if (process_esc_seq()) {
-            // clear the buffer
-            esc_seq.clear();
-            in_esc_seq = false;
+        if (fds[1].revents & POLLIN)
+            reap_jobs();
+
+        if (fds[2].revents & POLLIN) {
+            drain_completion_wake();
+            refresh_completions();
         }
+    }
+}
+
+void search_from(int from) {
+    int idx = search_history(search_query, from);
+
+    // Keep showing the last thing we found, like readline does
+    search_failed = idx == -1;
+
+    if (!search_failed)
+        search_idx = idx;
+}
+
+void start_search() {
+    completing = false;
+    searching = true;
+    search_failed = false;
+    search_idx = -1;
+    search_query.clear();
+    search_saved = cmd_buf.str();
+}
+
+// Puts whatever the search found (or, if cancelled, what was there before) back on the
+// command line
+void end_search(bool cancel) {
+    searching = false;
+
+    if (!cancel && search_idx != -1) {
+        cmd_buf.assign(history_at(search_idx));
+
+        // Up and down carry on through the history from here
+        history_idx = search_idx;
+        suggesting = true;
     } else {
-        switch (ch) {
-            case 0x1b: // ESCAPE
-                in_esc_seq = true;
-                break;
-            case 0x7f: // BACKSPACE (DELETE)
-                if (!cmd_str.empty()) {
-                    if (input_idx == INSERT_END) {
-                        cmd_str.pop_back();
-                        sout() << "\x08 \x08";
-                    } else if (input_idx != 0) {
-                        --input_idx;
-                        cmd_str.erase(input_idx, 1);
-                        sout() << "\x08\e[K" // Backspace and clear the rest of the line
-                               << cmd_str.substr(input_idx, string::npos) // Print the second part of the command
-                               << "\e[" << (cmd_str.length() - input_idx) << "D"; // Move the cursor back
-                    }
-                }
-                break;
-            case 0x20: // SPACE
-                sout() << "\e[J";
-
-                completing = false;
-
-                if (input_idx == INSERT_END) {
-                    cmd_str += ch;
-                    sout() << ch;
-                } else {
-                    cmd_str.insert(input_idx, 1, ch);
-                    sout() << cmd_str.substr(input_idx, string::npos)
-                           << "\e[" << (cmd_str.length() - 1 - input_idx) << "D";
-                    ++input_idx;
-                }
+        cmd_buf.assign(search_saved);
+    }
+}
 
-                break;
-            case 0x0a: // NEWLINE
-                if (completing && completion_idx > -1) {
-                    int len = arg.length();
-                    sout() << "\e[" << len << "D"
-                           << matches[completion_idx];
-                    cmd_str.replace(cmd_str.length() - arg.length(), len, matches[completion_idx]);
-                    completing = false;
-                    sout() << "\e[J";
-                    break;
-                }
+// Adds typed or pasted text to what we're searching for
+void search_text(const string &text) {
+    search_query += text;
 
-                sout() << std::endl << "\e[J";
-
-                cmd_enter(cmd_str);
-                history_idx = 0;
-                // If this command is running silently, we don't want it in our history.
-                // We also don't want it in our history if this command is the same as the
-                // last non-silent command we executed, or if the command is empty
-                if (echo_input && !cmd_str.empty() && (history.empty() || history.front() != cmd_str))
-                    history.insert(history.begin(), cmd_str);
-                cmd_str.clear();
-                suggesting = false;
-                input_idx = INSERT_END;
-                load_prompt();
-                sout() << prompt;
-                break;
-            case 0x09: // TAB
-                cmd_complete(cmd_str);
-                break;
-            case 0x0c: // Ctrl+L
-                cmd_enter("clear");
-                sout() << prompt << cmd_str;
-                break;
-            case 0x12: // Ctrl+R
-                sout() << "ctrl-r" << std::endl;
-                break;
-            case EOF:
-                break;
-            default:
-                if (input_idx == INSERT_END) {
-                    cmd_str += ch;
-                    sout() << ch;
-                } else {
-                    cmd_str.insert(input_idx, 1, ch);
-                    sout() << cmd_str.substr(input_idx, string::npos)
-                           << "\e[" << (cmd_str.length() - 1 - input_idx) << "D";
-                    ++input_idx;
-                }
+    // The command we're showing might well still match
+    search_from(search_idx == -1 ? 0 : search_idx);
+}
+
+// Handles a key during a reverse search. Returns false if the key ends the search and
+// should then be handled as usual.
+bool search_action(Action action) {
+    switch (action) {
+        case ACTION_SEARCH: {
+            if (search_query.empty())
+                return true;
+
+            // Skip over repeats of the command we're already showing
+            int idx = search_idx;
+
+            do {
+                idx = search_history(search_query, idx + 1);
+            } while (idx != -1 && search_idx != -1 && history_at(idx) == history_at(search_idx));
 
-                break;
+            search_failed = idx == -1;
+
+            if (!search_failed)
+                search_idx = idx;
+
+            return true;
         }
+        case ACTION_BACKSPACE:
+            if (!search_query.empty()) {
+                // Take off a whole character, not just its last byte
+                while (search_query.length() > 1 && (search_query.back() & 0xc0) == 0x80)
+                    search_query.pop_back();
+
+                search_query.pop_back();
+                search_from(0);
+            }
+
+            return true;
+        case ACTION_CANCEL:
+            end_search(true);
+            return true;
+        default:
+            end_search(false);
+            return false;
     }
 }
 
-void sig_int_callback(int s) {
-    cmd_str.clear();
-    in_esc_seq = false;
-    sout() << "\e[J" << std::endl << prompt;
-    getch_skip = true;
+// Inserts text at the cursor
+void insert_text(const string &text) {
+    // A space finishes off the word being completed
+    if (completing && text.find(' ') != string::npos)
+        completing = false;
+
+    cmd_buf.insert(text);
 }
 
-int next_pid_slot() {
-    for (int i = 0; i < suspended_pids.size(); ++i) {
-        if (suspended_pids[i] == -1)
-            return i;
+// Runs the command line, or with a completion selected, puts it in the line instead
+void accept_line() {
+    if (completing && completion_idx > -1) {
+        // Completions are of the end of the line, wherever the cursor was
+        string line = cmd_buf.str();
+        line.replace(line.length() - arg.length(), arg.length(), matches[completion_idx]);
+
+        cmd_buf.assign(line);
+        completing = false;
+        return;
     }
 
-    return -1;
+    leave_line();
+
+    string line = cmd_buf.str();
+    cmd_buf.clear();
+    cmd_enter(line);
+    history_idx = 0;
+
+    // If this command is running silently, we don't want it in our history.
+    // We also don't want it in our history if this command is the same as the
+    // last non-silent command we executed, or if the command is empty
+    if (echo_input && !line.empty() && (history_size() == 0 || history_at(0) != line))
+        add_history(line);
+
+    suggesting = false;
+    new_prompt();
 }
 
-void sig_tstp_callback(int s) {
-    if (active_pid != 0) {
-        kill(active_pid, SIGSTOP);
+// Does whatever a key is bound to
+void run_action(Action action) {
+    if (searching && search_action(action))
+        return;
 
-        int idx = next_pid_slot();
-        if (idx == -1) {
-            suspended_pids.push_back(active_pid);
-            idx = suspended_pids.size() - 1;
-        } else {
-            suspended_pids[idx] = active_pid;
+    switch (action) {
+        case ACTION_ACCEPT:
+            accept_line();
+            break;
+        case ACTION_COMPLETE:
+            cmd_complete(cmd_buf.str());
+            break;
+        case ACTION_BACKSPACE:
+            cmd_buf.erase_before();
+            break;
+        case ACTION_DELETE:
+            cmd_buf.erase_after();
+            break;
+        case ACTION_LEFT:
+            if (completing)
+                select_completions(DIRECTION_LEFT);
+            else
+                cmd_buf.move_left();
+            break;
+        case ACTION_RIGHT:
+            if (completing)
+                select_completions(DIRECTION_RIGHT);
+            else
+                cmd_buf.move_right();
+            break;
+        case ACTION_UP:
+            if (completing)
+                select_completions(DIRECTION_UP);
+            else
+                suggest(DIRECTION_UP);
+            break;
+        case ACTION_DOWN:
+            if (completing)
+                select_completions(DIRECTION_DOWN);
+            else
+                suggest(DIRECTION_DOWN);
+            break;
+        case ACTION_HOME:
+            cmd_buf.move_home();
+            break;
+        case ACTION_END:
+            cmd_buf.move_end();
+            break;
+        case ACTION_WORD_LEFT:
+            cmd_buf.move_word_left();
+            break;
+        case ACTION_WORD_RIGHT:
+            cmd_buf.move_word_right();
+            break;
+        case ACTION_KILL_WORD_BEFORE:
+            cmd_buf.erase_word_before();
+            break;
+        case ACTION_KILL_WORD_AFTER:
+            cmd_buf.erase_word_after();
+            break;
+        case ACTION_KILL_TO_START:
+            cmd_buf.erase_to_start();
+            break;
+        case ACTION_KILL_TO_END:
+            cmd_buf.erase_to_end();
+            break;
+        case ACTION_CLEAR_SCREEN:
+            cmd_enter("clear");
+            new_prompt();
+            break;
+        case ACTION_SEARCH:
+            start_search();
+            break;
+        case ACTION_CANCEL:
+            completing = false;
+            break;
+        default:
+            break;
+    }
+}
+
+// Pasted text goes in as it is, except that it has to stay on one line. Line breaks
+// separate commands with ; as they would in a script, trailing ones are dropped so a
+// paste never runs anything by itself, and other control characters become spaces.
+string clean_paste(const string &text) {
+    string out;
+    bool line_break = false;
+
+    out.reserve(text.length());
+
+    for (char ch : text) {
+        if (ch == '\n' || ch == '\r') {
+            line_break = !out.empty();
+            continue;
         }
 
-        sout() << std::endl << "\e[1m" << "Suspended PID [" << idx << "] " << active_pid << "\e[m" << std::endl;
+        if (line_break)
+            out += "; ";
+
+        line_break = false;
+        out += (unsigned char) ch < 0x20 || ch == 0x7f ? ' ' : ch;
     }
 
-    getch_skip = true;
+    return out;
 }
 
-void cleanup() {
-    if (pid != 0)
-        save_history();
+void process_key(const Key &key) {
+    if (key.type == KEY_TEXT || key.type == KEY_PASTE) {
+        string text = key.type == KEY_PASTE ? clean_paste(key.text) : key.text;
+
+        if (searching)
+            search_text(text);
+        else
+            insert_text(text);
+    } else {
+        run_action(lookup_key(key.text));
+    }
+}
+
+// Ctrl+C gives up on the line, leaving it on screen, and starts a new one
+void interrupt_line() {
+    interrupted = 0;
+    searching = false;
+    leave_line();
+    cmd_buf.clear();
+    suggesting = false;
+    new_prompt();
+}
+
+void sig_winch_callback(int s) {
+    render_resized();
+}
+
+void sig_int_callback(int s) {
+    // Dealt with once the read it interrupts returns, rather than drawing from in here
+    interrupted = 1;
 }
 
 int main(int argc, char **argv) {
+    shell_pid = getpid();
+
     // Register our SIGINT handler
     struct sigaction sig_int_handler;
     sig_int_handler.sa_handler = sig_int_callback;
@@ -953,19 +1505,13 @@ int main(int argc, char **argv) {
     sig_int_handler.sa_flags = 0;
     sigaction(SIGINT, &sig_int_handler, NULL);
 
-    // Register our SIGTSTP handler
-    struct sigaction sig_tstp_handler;
-    sig_tstp_handler.sa_handler = sig_tstp_callback;
-    sigemptyset(&sig_tstp_handler.sa_mask);
-    sig_tstp_handler.sa_flags = 0;
-    sigaction(SIGTSTP, &sig_tstp_handler, NULL);
-
-    std::atexit(cleanup);
-
-    // Setup our pipes
-    pipe(pipefd_input);
-    pipe(pipefd_output);
-    pipe(pipefd_subc);
+    // Register our SIGWINCH handler, restarting whatever it interrupts, as the size is
+    // only needed the next time we draw
+    struct sigaction sig_winch_handler;
+    sig_winch_handler.sa_handler = sig_winch_callback;
+    sigemptyset(&sig_winch_handler.sa_mask);
+    sig_winch_handler.sa_flags = SA_RESTART;
+    sigaction(SIGWINCH, &sig_winch_handler, NULL);
 
     // Setup our environment variables
     setenv("SHELL", SHELL_NAME, true);
@@ -978,6 +1524,7 @@ int main(int argc, char **argv) {
         { "or",       builtins::bor },
         { "redirect", builtins::bredirect },
         { "silence",  builtins::bsilence },
+        { "split",    builtins::bsplit },
         { "set",      builtins::bset },
         { "unset",    builtins::bunset },
         { "ladd",     builtins::bladd },
@@ -991,35 +1538,59 @@ int main(int argc, char **argv) {
         { "without",  builtins::bwithout },
         { "which",    builtins::bwhich },
         { "fg",       builtins::bfg },
+        { "bg",       builtins::bbg },
+        { "jobs",     builtins::bjobs },
+        { "wait",     builtins::bwait },
         { "kill",     builtins::bkill },
         { "run",      builtins::brun },
         { "source",   builtins::bsource },
         { "history",  builtins::bhistory },
-        { "debug",    builtins::bdebug }
+        { "debug",    builtins::bdebug },
+        { "bind",     builtins::bbind },
+        { "status",   builtins::bstatus },
+        { "timeout",  builtins::btimeout }
     };
 
     if (argc < 2) {
         initialize_path(); // This actually initializes the PATH variable using /etc/paths
     }
 
-    load_path(); // This reads the PATH variable to determine full paths to commands
-
     // Loading from script
     if (argc > 1) {
+        init_jobs(false);
+        load_path(); // This reads the PATH variable to determine full paths to commands
         execute_script(string(argv[1]));
         return 0;
     }
 
-    load_rc(); // Here, edits could potentially be made to PATH...
-    load_path(); // hence we reload the PATH
-    load_prompt();
+    init_jobs(isatty(STDIN_FILENO));
+
+    init_keymap(); // Before the rc file, which can rebind keys
+    load_rc(); // This also brings the PATH index up to date
     load_history();
 
-    sout() << prompt;
+    // Before the first prompt, so that it can ask the terminal where the cursor is
+    raw_mode_on();
+
+    new_prompt();
+
+    Key key;
+
+    for (;;) {
+        wait_for_input();
+
+        if (interrupted) {
+            interrupt_line();
+            continue;
+        }
+
+        // A signal interrupting the read just means there's no key this time around
+        int got = read_key(&key);
 
-    while ((c = getch()) != EOF || getch_skip) {
-        process_keypress(c);
-        getch_skip = false;
+        if (got == 0)
+            break;
+        if (got > 0)
+            process_key(key);
     }
 
     return 0;
@@ -0,0 +1,348 @@
+#include "config.h"
+#include "global.h"
+#include "paths.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <dirent.h>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#ifdef __linux__
+#include <climits>
+#include <sys/inotify.h>
+#endif
+
+using std::string;
+
+// Everything we know about a single PATH directory
+struct PathDir {
+    int wd = -1;
+    std::unordered_set<string> names;
+};
+
+static std::map<string, PathDir> path_dirs;
+static std::vector<string> path_order;
+static std::unordered_map<int, string> path_watches;
+static string synced_path;
+static bool synced = false;
+static int inotify_fd = -1;
+
+static string full_path(const string &dir, const string &name) {
+    if (!dir.empty() && dir.back() == '/')
+        return dir + name;
+
+    return dir + '/' + name;
+}
+
+static void watch_dir(const string &dir, PathDir &entry) {
+#ifdef __linux__
+    if (inotify_fd == -1)
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (inotify_fd == -1)
+        return;
+
+    entry.wd = inotify_add_watch(inotify_fd, dir.c_str(),
+        IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+
+    if (entry.wd != -1)
+        path_watches[entry.wd] = dir;
+#endif
+}
+
+static void unwatch_dir(PathDir &entry) {
+#ifdef __linux__
+    if (entry.wd == -1)
+        return;
+
+    inotify_rm_watch(inotify_fd, entry.wd);
+    path_watches.erase(entry.wd);
+    entry.wd = -1;
+#endif
+}
+
+// Lists a directory into entry, returning false if it couldn't be opened
+static bool files_in_dir(const string &path, PathDir &entry) {
+    DIR *dir = opendir(path.c_str());
+
+    if (dir == nullptr)
+        return false;
+
+    while (struct dirent *file = readdir(dir)) {
+        const char *name = file->d_name;
+
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+
+        entry.names.emplace(name);
+    }
+
+    closedir(dir);
+
+    return true;
+}
+
+// Cold directory reads are mostly waiting on the disk (or the network), so a
+// handful of threads each take the next unscanned directory until none are left
+static void scan_dirs(const std::vector<string> &dirs) {
+    std::vector<PathDir*> entries;
+    std::vector<char> valid(dirs.size(), false);
+    std::atomic<size_t> next = 0;
+
+    for (const string &dir : dirs)
+        entries.push_back(&path_dirs[dir]);
+
+    auto worker = [&]() {
+        size_t i;
+
+        while ((i = next++) < dirs.size())
+            valid[i] = files_in_dir(dirs[i], *entries[i]);
+    };
+
+    size_t nthreads = std::min<size_t>(dirs.size(), PATH_SCAN_THREADS);
+
+    if (nthreads > 1) {
+        std::vector<std::thread> threads;
+
+        for (size_t t = 1; t < nthreads; ++t)
+            threads.emplace_back(worker);
+
+        worker();
+
+        for (std::thread &thread : threads)
+            thread.join();
+    } else {
+        worker();
+    }
+
+    for (size_t i = 0; i < dirs.size(); ++i) {
+        if (!valid[i] && echo_input)
+            std::cerr << dirs[i] << " is not a valid directory" << std::endl;
+    }
+}
+
+// Earlier PATH entries win, just like they do when a command is looked up. Sorting
+// everything once and inserting in order beats a tree insert for every file.
+static void rebuild_executables() {
+    std::vector<std::pair<const string*, size_t>> entries;
+
+    for (size_t rank = 0; rank < path_order.size(); ++rank) {
+        for (const string &name : path_dirs[path_order[rank]].names)
+            entries.emplace_back(&name, rank);
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const auto &a, const auto &b) {
+        int cmp = a.first->compare(*b.first);
+        return cmp < 0 || (cmp == 0 && a.second < b.second);
+    });
+
+    executable_map.clear();
+
+    for (const auto &[name, rank] : entries) {
+        if (!executable_map.empty() && std::prev(executable_map.end())->first == *name)
+            continue;
+
+        executable_map.emplace_hint(executable_map.end(), *name, full_path(path_order[rank], *name));
+    }
+}
+
+static void executable_added(const string &dir, const string &name) {
+    for (const string &other : path_order) {
+        if (other == dir)
+            break;
+
+        // Shadowed by a directory that comes first
+        if (path_dirs[other].names.count(name))
+            return;
+    }
+
+    executable_map[name] = full_path(dir, name);
+}
+
+static void executable_removed(const string &dir, const string &name) {
+    auto executable = executable_map.find(name);
+
+    if (executable == executable_map.end() || executable->second != full_path(dir, name))
+        return;
+
+    // Fall back to the next directory on PATH that has it
+    for (const string &other : path_order) {
+        if (other != dir && path_dirs[other].names.count(name)) {
+            executable->second = full_path(other, name);
+            return;
+        }
+    }
+
+    executable_map.erase(executable);
+}
+
+// Brings the index in line with $PATH. Only directories that weren't already on
+// PATH get scanned; the rest are kept up to date by refresh_path(). Passing true
+// throws everything away and rescans from scratch.
+void load_path(bool rescan) {
+    const char* c_path = std::getenv("PATH");
+    string path(c_path ?: "");
+
+    if (synced && !rescan && path == synced_path)
+        return;
+
+    std::vector<string> order;
+    std::unordered_set<string> seen;
+
+    path += ':';
+
+    size_t pos = 0;
+    size_t last = 0;
+    while ((pos = path.find(':', last)) != string::npos) {
+        string dir = path.substr(last, pos - last);
+        last = pos + 1;
+
+        if (!dir.empty() && seen.insert(dir).second)
+            order.push_back(dir);
+    }
+
+    // Forget directories that have left PATH
+    for (auto it = path_dirs.begin(); it != path_dirs.end();) {
+        if (rescan || !seen.count(it->first)) {
+            unwatch_dir(it->second);
+            it = path_dirs.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    // and scan the ones that have joined it, watching first so nothing slips by
+    std::vector<string> to_scan;
+
+    for (const string &dir : order) {
+        if (path_dirs.count(dir))
+            continue;
+
+        watch_dir(dir, path_dirs[dir]);
+        to_scan.push_back(dir);
+    }
+
+    scan_dirs(to_scan);
+
+    path_order = std::move(order);
+    synced_path = c_path ?: "";
+    synced = true;
+
+    rebuild_executables();
+}
+
+// The index in PATH order, for saving it in a snapshot
+std::vector<PathListing> path_listings() {
+    std::vector<PathListing> listings;
+
+    for (const string &dir : path_order) {
+        const PathDir &entry = path_dirs[dir];
+        listings.push_back({ dir, std::vector<string>(entry.names.begin(), entry.names.end()) });
+    }
+
+    return listings;
+}
+
+// Takes over an index saved by path_listings() instead of scanning $PATH. The
+// caller is responsible for making sure the listings are still current.
+void restore_path(const std::vector<PathListing> &listings) {
+    for (auto &[dir, entry] : path_dirs)
+        unwatch_dir(entry);
+
+    path_dirs.clear();
+    path_order.clear();
+
+    for (const PathListing &listing : listings) {
+        PathDir &entry = path_dirs[listing.dir];
+        watch_dir(listing.dir, entry);
+        entry.names.insert(listing.names.begin(), listing.names.end());
+        path_order.push_back(listing.dir);
+    }
+
+    const char* c_path = std::getenv("PATH");
+    synced_path = c_path ?: "";
+    synced = true;
+
+    rebuild_executables();
+}
+
+// Picks up PATH directories that didn't exist when we last looked, or were deleted or
+// moved away since. Trying to watch one is all it takes to find out if it's back.
+static void rewatch_missing() {
+    for (const string &dir : path_order) {
+        PathDir &entry = path_dirs[dir];
+
+        if (entry.wd != -1)
+            continue;
+
+        watch_dir(dir, entry);
+
+        if (entry.wd == -1 || !files_in_dir(dir, entry))
+            continue;
+
+        for (const string &name : entry.names)
+            executable_added(dir, name);
+    }
+}
+
+// Applies any changes the kernel has told us about since the last call
+void refresh_path() {
+#ifdef __linux__
+    if (inotify_fd == -1)
+        return;
+
+    rewatch_missing();
+
+    alignas(struct inotify_event) char buf[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+    ssize_t nread;
+
+    while ((nread = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + nread;) {
+            auto event = (struct inotify_event*) p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                // We missed something, so there's nothing to do but start over
+                load_path(true);
+                return;
+            }
+
+            auto watch = path_watches.find(event->wd);
+            if (watch == path_watches.end())
+                continue;
+
+            string dir = watch->second;
+            PathDir &entry = path_dirs[dir];
+
+            if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                if (entry.names.insert(event->name).second)
+                    executable_added(dir, event->name);
+            } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                if (entry.names.erase(event->name))
+                    executable_removed(dir, event->name);
+            } else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                std::unordered_set<string> names = std::move(entry.names);
+                entry.names.clear();
+
+                for (const string &name : names)
+                    executable_removed(dir, name);
+
+                if (event->mask & IN_IGNORED) {
+                    path_watches.erase(watch);
+                    entry.wd = -1;
+                } else {
+                    unwatch_dir(entry);
+                }
+            }
+        }
+    }
+#endif
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+struct PathListing {
+    std::string dir;
+    std::vector<std::string> names;
+};
+
+void load_path(bool = false);
+void refresh_path();
+std::vector<PathListing> path_listings();
+void restore_path(const std::vector<PathListing>&);
@@ -0,0 +1,430 @@
+#include "config.h"
+#include "input.h"
+#include "linebuf.h"
+#include "render.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <iostream>
+#include <string_view>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+using std::string;
+
+// The line editor's part of the screen is kept as a grid of cells, as it was last
+// drawn, starting from the row the prompt is on. Each frame is laid out into a grid
+// the same way, only the cells that differ are redrawn, and all of it goes to the
+// terminal in a single write. Moving through the completion menu rewrites the two
+// entries that changed rather than the whole menu.
+//
+// Where the cursor is comes from the layout, never from asking the terminal, and the
+// size of the terminal is only looked up again after it's been resized. The one
+// exception is starting a prompt after a command ran, when only the terminal knows
+// whether the command's output ended partway through a line.
+
+struct Cell {
+    string text;  // Empty for the second column of a wide character
+    string style; // The SGR sequences in effect for it
+
+    bool operator==(const Cell&) const = default;
+};
+
+using Row = std::vector<Cell>;
+
+// What gets drawn in a cell, or in two for wide characters
+struct Glyph {
+    string text;
+    string style;
+    int width;
+};
+
+static std::vector<Row> shown;
+static int rows_claimed = 0; // Rows the area has taken up on screen, blank or not
+static int cursor_row = 0;
+static int cursor_col = 0;   // -1 after writing the last column, when it's ambiguous
+static int columns = 80;
+static int lines = 24;
+static string current_style;
+static string out;
+static volatile sig_atomic_t size_changed = 1;
+static bool at_line_start = false; // Whether nothing has been written since our last newline
+
+static void flush_out() {
+    // Anything written through the streams has to come first
+    std::cout << std::flush;
+
+    for (size_t done = 0; done < out.length();) {
+        ssize_t nwritten = write(STDOUT_FILENO, out.data() + done, out.length() - done);
+
+        if (nwritten < 0 && errno != EINTR)
+            break;
+        if (nwritten > 0)
+            done += nwritten;
+    }
+
+    out.clear();
+}
+
+static void forget() {
+    shown.clear();
+    rows_claimed = 1;
+    cursor_row = 0;
+    cursor_col = 0;
+    current_style.clear();
+}
+
+// Picks up the size of the terminal if it's changed. Narrowing the terminal can make
+// it rewrap what we drew, and as we never wrap rows by writing past their ends, each
+// row that's too long now takes up more than one. We go back to where the area starts
+// after that, clear it and draw it all again.
+static void update_size() {
+    struct winsize size;
+    int old_columns = columns;
+
+    if (!size_changed)
+        return;
+
+    size_changed = 0;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 && size.ws_row > 0) {
+        columns = size.ws_col;
+        lines = size.ws_row;
+    }
+
+    if (columns == old_columns || shown.empty())
+        return;
+
+    int up = (cursor_col < 0 ? old_columns - 1 : cursor_col) / columns;
+
+    for (int r = 0; r < cursor_row && r < (int) shown.size(); ++r)
+        up += std::max<int>(1, (shown[r].size() + columns - 1) / columns);
+
+    if (up > 0)
+        out += "\e[" + std::to_string(up) + "A";
+
+    out += "\r\e[m\e[J";
+    forget();
+}
+
+// Called from the SIGWINCH handler, so all it does is note that the size needs looking up
+void render_resized() {
+    size_changed = 1;
+}
+
+// Length of the escape sequence at pos
+static size_t escape_length(std::string_view text, size_t pos) {
+    size_t i = pos + 2;
+
+    if (i > text.length())
+        return 1;
+
+    if (text[pos + 1] == '[') {
+        while (i < text.length() && (text[i] < 0x40 || text[i] > 0x7e))
+            ++i;
+
+        return std::min(i + 1, text.length()) - pos;
+    }
+
+    // Operating system commands, like setting the title, run until BEL or ST
+    if (text[pos + 1] == ']') {
+        while (i < text.length() && text[i] != '\a' && !(text[i] == '\\' && text[i - 1] == 0x1b))
+            ++i;
+
+        return std::min(i + 1, text.length()) - pos;
+    }
+
+    return 2;
+}
+
+// Splits text into what the terminal draws in each cell. With escapes, colours and
+// the like carry over to the glyphs after them and any other sequence is sent along
+// with the next glyph; without, escapes are shown like any other control character.
+// Returns which glyph the byte at mark starts.
+static size_t add_glyphs(std::vector<Glyph> &glyphs, std::string_view text, string &style, bool escapes, size_t mark = string::npos) {
+    size_t marked = string::npos;
+    string pending;
+
+    for (size_t pos = 0; pos < text.length();) {
+        unsigned char ch = text[pos];
+
+        if (pos >= mark && marked == string::npos)
+            marked = glyphs.size();
+
+        if (ch == 0x1b && escapes) {
+            std::string_view seq = text.substr(pos, escape_length(text, pos));
+
+            if (seq == "\e[m" || seq == "\e[0m")
+                style.clear();
+            else if (seq.length() > 2 && seq[1] == '[' && seq.back() == 'm')
+                style += seq;
+            else
+                pending += seq;
+
+            pos += seq.length();
+            continue;
+        }
+
+        if (ch < 0x20 || ch == 0x7f) {
+            glyphs.push_back({ pending + '^' + (char) (ch ^ 0x40), style, 2 });
+            pending.clear();
+            ++pos;
+            continue;
+        }
+
+        size_t end = grapheme_end(text, pos);
+        std::string_view grapheme = text.substr(pos, end - pos);
+        int width = display_width(grapheme);
+
+        // Combining marks with nothing of their own to combine with go on the glyph before
+        if (width == 0 && !glyphs.empty() && pending.empty())
+            glyphs.back().text += grapheme;
+        else
+            glyphs.push_back({ pending + string(grapheme), style, std::max(width, 1) });
+
+        pending.clear();
+        pos = end;
+    }
+
+    if (!pending.empty() && !glyphs.empty())
+        glyphs.back().text += pending;
+
+    return marked == string::npos ? glyphs.size() : marked;
+}
+
+static void add_cells(Row &row, const Glyph &glyph, const string &style) {
+    row.push_back({ glyph.text, style });
+
+    for (int i = 1; i < glyph.width; ++i)
+        row.push_back({ "", style });
+}
+
+// Wraps the glyphs into rows like the terminal would, a wide character that doesn't
+// fit at the end of a row going on to the next, and finds where the cursor glyph lands
+static void lay_out(std::vector<Row> &rows, const std::vector<Glyph> &glyphs, size_t cursor, int *row, int *col) {
+    rows.emplace_back();
+
+    for (size_t i = 0; i < glyphs.size(); ++i) {
+        if ((int) rows.back().size() + glyphs[i].width > columns)
+            rows.emplace_back();
+
+        if (i == cursor) {
+            *row = rows.size() - 1;
+            *col = rows.back().size();
+        }
+
+        add_cells(rows.back(), glyphs[i], glyphs[i].style);
+    }
+
+    if (cursor >= glyphs.size()) {
+        // A cursor after a full row sits at the start of the next one
+        if ((int) rows.back().size() >= columns)
+            rows.emplace_back();
+
+        *row = rows.size() - 1;
+        *col = rows.back().size();
+    }
+}
+
+// Lays out the menu in COMPLETION_COLUMNS columns, showing the rows around the
+// selected entry when there are more than max_rows of them
+static void lay_out_menu(std::vector<Row> &rows, const Frame &frame, int max_rows) {
+    const std::vector<string> &menu = *frame.menu;
+    int chars_per_col = columns / COMPLETION_COLUMNS - 1;
+    int menu_rows = (menu.size() + COMPLETION_COLUMNS - 1) / COMPLETION_COLUMNS;
+    int first = 0;
+
+    if (chars_per_col < 1)
+        return;
+
+    if (frame.selected >= 0 && frame.selected / COMPLETION_COLUMNS >= max_rows)
+        first = frame.selected / COMPLETION_COLUMNS - max_rows + 1;
+
+    for (int r = first; r < menu_rows && r < first + max_rows; ++r) {
+        Row &row = rows.emplace_back();
+
+        for (int i = r * COMPLETION_COLUMNS; i < (int) menu.size() && i < (r + 1) * COMPLETION_COLUMNS; ++i) {
+            string style = i == frame.selected ? "\e[7m" : ""; // Invert the selected entry
+            std::vector<Glyph> glyphs;
+            string unused;
+            int used = 0;
+
+            if (i > r * COMPLETION_COLUMNS)
+                row.push_back({ " ", "" });
+
+            add_glyphs(glyphs, menu[i], unused, false);
+
+            for (const Glyph &glyph : glyphs) {
+                if (used + glyph.width > chars_per_col)
+                    break;
+
+                add_cells(row, glyph, style);
+                used += glyph.width;
+            }
+
+            for (; used < chars_per_col; ++used)
+                row.push_back({ " ", style });
+        }
+    }
+}
+
+static void set_style(const string &style) {
+    if (style == current_style)
+        return;
+
+    if (!current_style.empty())
+        out += "\e[m";
+
+    out += style;
+    current_style = style;
+}
+
+// Moves the cursor to a cell in the area. Rows below what the area has taken up so far
+// are reached with newlines, so the terminal scrolls if it has to.
+static void move_to(int row, int col) {
+    if (row > cursor_row) {
+        int existing = std::min(row, rows_claimed - 1);
+
+        if (existing > cursor_row)
+            out += "\e[" + std::to_string(existing - cursor_row) + "B";
+
+        if (row > existing) {
+            set_style("");
+
+            for (int i = existing; i < row; ++i)
+                out += "\r\n";
+
+            rows_claimed = row + 1;
+            cursor_col = 0;
+        }
+    } else if (row < cursor_row) {
+        out += "\e[" + std::to_string(cursor_row - row) + "A";
+    }
+
+    cursor_row = row;
+
+    if (col != cursor_col)
+        out += col == 0 ? "\r" : "\e[" + std::to_string(col + 1) + "G";
+
+    cursor_col = col;
+}
+
+static inline bool continues(const Row &row, size_t col) {
+    return col < row.size() && row[col].text.empty();
+}
+
+// Redraws the cells of a row that changed, never starting or stopping partway through
+// a wide character, and clears whatever's left over from a longer row
+static void draw_row(int r, const Row &old, const Row &now) {
+    size_t common = std::min(old.size(), now.size());
+    size_t start = 0;
+    size_t end = now.size();
+
+    while (start < common && old[start] == now[start])
+        ++start;
+
+    if (now.size() == old.size()) {
+        if (start == now.size())
+            return;
+
+        while (end > start && old[end - 1] == now[end - 1])
+            --end;
+    }
+
+    while (start > 0 && (continues(now, start) || continues(old, start)))
+        --start;
+    while (end < now.size() && (continues(now, end) || continues(old, end)))
+        ++end;
+
+    if (start < end) {
+        move_to(r, start);
+
+        for (size_t col = start; col < end; ++col) {
+            if (now[col].text.empty())
+                continue;
+
+            set_style(now[col].style);
+            out += now[col].text;
+        }
+
+        cursor_col = (int) end < columns ? end : -1;
+    }
+
+    if (now.size() < old.size()) {
+        move_to(r, now.size());
+        set_style("");
+        out += "\e[K";
+    }
+}
+
+// Starts a new area wherever the cursor is. Output that didn't end its line gets a
+// marker after it and the area starts on the next line, as in zsh: the marker and a
+// row's worth of spaces either fill the line the cursor started at the beginning of,
+// and then get cleared, or wrap on to the next line.
+// Called when something besides the line editor might have written to the terminal
+void render_lost_cursor() {
+    at_line_start = false;
+}
+
+void render_start() {
+    update_size();
+
+    // Output that didn't end with a newline gets marked, and the prompt goes on the
+    // next line rather than over the end of it
+    if (!at_line_start && isatty(STDOUT_FILENO) && cursor_column() != 1) {
+        out += "\e[7m%\e[m";
+        out.append(columns - 1, ' ');
+        out += "\r\e[K";
+    }
+
+    at_line_start = false;
+    forget();
+    flush_out();
+}
+
+void render_frame(const Frame &frame) {
+    static const Row empty;
+    std::vector<Glyph> glyphs;
+    std::vector<Row> rows;
+    string style;
+    int row = 0;
+    int col = 0;
+
+    update_size();
+
+    add_glyphs(glyphs, frame.prompt, style, true);
+    size_t cursor = add_glyphs(glyphs, frame.line, style, false, frame.cursor);
+    lay_out(rows, glyphs, cursor, &row, &col);
+
+    // The menu can't go past the bottom of the screen, or we couldn't move back up
+    if (frame.menu && (int) rows.size() < lines)
+        lay_out_menu(rows, frame, lines - rows.size());
+
+    for (size_t r = 0; r < rows.size(); ++r)
+        draw_row(r, r < shown.size() ? shown[r] : empty, rows[r]);
+
+    if (rows.size() < shown.size()) {
+        move_to(rows.size(), 0);
+        set_style("");
+        out += "\e[J";
+    }
+
+    set_style("");
+    move_to(row, col);
+    shown = std::move(rows);
+
+    flush_out();
+}
+
+// Moves to the line after everything drawn, leaving it on screen, for whatever gets
+// written next
+void render_newline() {
+    move_to(std::max((int) shown.size(), 1) - 1, cursor_col);
+    set_style("");
+    out += "\r\n";
+
+    forget();
+    flush_out();
+    at_line_start = true;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Everything the line editor shows: the last line of the prompt, the command line
+// after it with the cursor somewhere in it, and the completion menu below them
+struct Frame {
+    std::string prompt;
+    std::string line;
+    size_t cursor = 0; // Byte offset into line
+    const std::vector<std::string> *menu = nullptr;
+    int selected = -1;
+};
+
+void render_resized();
+void render_lost_cursor();
+void render_start();
+void render_frame(const Frame&);
+void render_newline();
@@ -0,0 +1,472 @@
+#include "builtins.h"
+#include "config.h"
+#include "global.h"
+#include "paths.h"
+#include "snapshot.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using std::string;
+
+extern char **environ;
+
+// A snapshot records what running the rc file did to the shell: changes to the
+// environment, the aliases it defined and the PATH index it ended up with. Along
+// with that go the variables the rc file read and what its exists checks found,
+// so the snapshot is only used while those are still the same. Lines that did
+// something else (printing a greeting, cd) without touching that state are saved
+// as they are and run again after the snapshot is loaded.
+
+static const char snapshot_magic[8] = { 'W', 'S', 'H', 'S', 'N', 'A', 'P', '2' };
+
+// Builtins that do nothing but change the state a snapshot saves
+static const std::set<string> replayable_builtins = {
+    "and", "or", "equals", "ladd", "radd", "redirect", "reload",
+    "set", "silence", "unalias", "unset", "with", "without",
+};
+
+// Builtins that only look at the system, checked again when the snapshot is loaded
+static const std::set<string> probe_builtins = { "exists" };
+
+struct Probe {
+    std::vector<string> args;
+    int status;
+};
+
+static bool recording = false;
+static bool replayable = false;
+static uint64_t recording_key = 0;
+static std::map<string, string> env_before;
+static std::set<string> vars_read;
+static std::vector<Probe> probes;
+
+// What the rc line being run has done so far
+static int line_depth = 0;
+static bool line_rerun = false;
+static std::map<string, string> line_env;
+static std::map<string, string> line_aliases;
+static std::vector<string> rerun_lines;
+
+static string snapshot_path() {
+    return home_dir() + '/' + SNAPSHOT_FILENAME;
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+    auto bytes = (const unsigned char*) data;
+
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3;
+    }
+
+    return hash;
+}
+
+static uint64_t fnv1a(uint64_t hash, const string &str) {
+    // Include the length so that neighbouring strings can't run together
+    size_t len = str.length();
+    hash = fnv1a(hash, &len, sizeof(len));
+    return fnv1a(hash, str.data(), len);
+}
+
+static std::map<string, string> current_env() {
+    std::map<string, string> env;
+
+    for (char **var = environ; *var != nullptr; ++var) {
+        const char *eq = strchr(*var, '=');
+
+        if (eq != nullptr)
+            env.emplace(string(*var, eq - *var), string(eq + 1));
+    }
+
+    return env;
+}
+
+// The rc file itself. The variables it read, its probes and the PATH directories
+// are saved alongside and checked one by one when the snapshot is loaded.
+static uint64_t snapshot_key(const string &rc) {
+    uint64_t hash = 0xcbf29ce484222325;
+
+    hash = fnv1a(hash, std::to_string(VERSION_MAJOR) + "." + std::to_string(VERSION_MINOR) + "." + std::to_string(VERSION_PATCH));
+    hash = fnv1a(hash, rc);
+
+    if (!rc.empty()) {
+        std::ifstream fin(rc, std::ios::binary);
+        hash = fnv1a(hash, string(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>()));
+    }
+
+    return hash;
+}
+
+// Values are only compared, so there's no need to keep them around in the file
+static uint64_t var_hash(const char *value) {
+    if (value == nullptr)
+        return 0;
+
+    return fnv1a(0xcbf29ce484222325, string(value)) | 1;
+}
+
+static int run_probe(const std::vector<string> &args) {
+    auto builtin = builtins_map.find(args[0]);
+
+    if (builtin == builtins_map.end())
+        return -1;
+
+    std::vector<string> copy = args;
+    std::vector<char*> argv;
+
+    for (string &arg : copy)
+        argv.push_back(arg.data());
+    argv.push_back(nullptr);
+
+    Effects effects;
+    return builtin->second(copy.size(), argv.data(), &effects);
+}
+
+template <typename T>
+static void put(string &buf, T value) {
+    buf.append((const char*) &value, sizeof(value));
+}
+
+static void put(string &buf, const string &str) {
+    put<uint32_t>(buf, str.length());
+    buf += str;
+}
+
+// Bounds-checked reads out of the mapped snapshot
+struct SnapshotReader {
+    const char *p;
+    const char *end;
+    bool ok = true;
+
+    template <typename T>
+    T get() {
+        T value {};
+
+        if (ok && (size_t) (end - p) >= sizeof(T)) {
+            memcpy(&value, p, sizeof(T));
+            p += sizeof(T);
+        } else {
+            ok = false;
+        }
+
+        return value;
+    }
+
+    string get_str() {
+        uint32_t len = get<uint32_t>();
+
+        if (!ok || (size_t) (end - p) < len) {
+            ok = false;
+            return "";
+        }
+
+        string str(p, len);
+        p += len;
+        return str;
+    }
+};
+
+// Restores the state saved by an earlier run of the same rc file, and hands back
+// the lines that still have to be run. Returns false, without touching anything,
+// if there's no snapshot or it's out of date.
+bool load_snapshot(const string &rc, std::vector<string> &rerun) {
+#if USE_SNAPSHOT
+    int fd = open(snapshot_path().c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+        return false;
+
+    struct stat info;
+
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t) (sizeof(snapshot_magic) + sizeof(uint64_t))) {
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+        return false;
+
+    SnapshotReader in = { (const char*) data, (const char*) data + info.st_size };
+
+    std::vector<std::pair<string, string>> sets;
+    std::vector<string> unsets;
+    std::vector<std::pair<string, string>> aliases;
+    std::vector<PathListing> listings;
+    bool valid = memcmp(in.p, snapshot_magic, sizeof(snapshot_magic)) == 0;
+
+    in.p += sizeof(snapshot_magic);
+    valid = valid && in.get<uint64_t>() == snapshot_key(rc);
+
+    if (valid) {
+        for (uint32_t n = in.get<uint32_t>(); in.ok && valid && n > 0; --n) {
+            string name = in.get_str();
+            valid = in.get<uint64_t>() == var_hash(std::getenv(name.c_str()));
+        }
+
+        for (uint32_t n = in.get<uint32_t>(); in.ok && valid && n > 0; --n) {
+            std::vector<string> args;
+
+            for (uint32_t m = in.get<uint32_t>(); in.ok && m > 0; --m)
+                args.push_back(in.get_str());
+
+            int status = in.get<int32_t>();
+            valid = in.ok && !args.empty() && run_probe(args) == status;
+        }
+    }
+
+    if (valid) {
+        for (uint32_t n = in.get<uint32_t>(); in.ok && n > 0; --n) {
+            string name = in.get_str();
+            sets.emplace_back(name, in.get_str());
+        }
+
+        for (uint32_t n = in.get<uint32_t>(); in.ok && n > 0; --n)
+            unsets.push_back(in.get_str());
+
+        for (uint32_t n = in.get<uint32_t>(); in.ok && n > 0; --n) {
+            string name = in.get_str();
+            aliases.emplace_back(name, in.get_str());
+        }
+
+        for (uint32_t n = in.get<uint32_t>(); in.ok && valid && n > 0; --n) {
+            PathListing listing;
+            listing.dir = in.get_str();
+
+            // A directory that changed means the rc file might behave differently now
+            valid = in.get<int64_t>() == modified_time(listing.dir);
+
+            for (uint32_t m = in.get<uint32_t>(); in.ok && m > 0; --m)
+                listing.names.push_back(in.get_str());
+
+            listings.push_back(std::move(listing));
+        }
+
+        for (uint32_t n = in.get<uint32_t>(); in.ok && n > 0; --n)
+            rerun.push_back(in.get_str());
+
+        valid = valid && in.ok;
+    }
+
+    munmap(data, info.st_size);
+
+    if (!valid) {
+        rerun.clear();
+        return false;
+    }
+
+    for (const auto &[name, value] : sets)
+        setenv(name.c_str(), value.c_str(), true);
+
+    for (const string &name : unsets)
+        unsetenv(name.c_str());
+
+    for (const auto &[name, value] : aliases)
+        alias_map[name] = value;
+
+    restore_path(listings);
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Starts watching what the rc file does
+void begin_snapshot(const string &rc) {
+#if USE_SNAPSHOT
+    recording = true;
+    replayable = true;
+    recording_key = snapshot_key(rc);
+    env_before = current_env();
+#endif
+}
+
+// Called before and after each line of the rc file, to tell the lines that only
+// changed the saved state from the ones that have to run every time
+void observe_line_start() {
+    if (!recording || line_depth++ > 0)
+        return;
+
+    line_rerun = false;
+    line_env = current_env();
+    line_aliases = alias_map;
+}
+
+void observe_line_end(const string &line) {
+    if (!recording || --line_depth > 0 || !line_rerun)
+        return;
+
+    // A line that has to run again can't also be one the snapshot stands in for
+    if (current_env() != line_env || alias_map != line_aliases)
+        replayable = false;
+    else
+        rerun_lines.push_back(line);
+}
+
+// Called for every variable that's read, since the rc file might do something
+// else once it changes
+void observe_var(const string &name) {
+    if (recording)
+        vars_read.insert(name);
+}
+
+// Called for every command that runs. Commands feeding a subcommand only matter
+// through what they print, which ends up in the saved state if it's used at all.
+void observe_command(int argc, char **args, bool is_builtin, bool captured) {
+    if (!recording || !replayable)
+        return;
+
+    string name(args[0]);
+
+    if (is_builtin && probe_builtins.count(name)) {
+        Probe probe;
+        probe.args.assign(args, args + argc);
+        probe.status = run_probe(probe.args);
+        probes.push_back(std::move(probe));
+        return;
+    }
+
+    // These take the name of a variable and read it
+    if (is_builtin && argc >= 2 && (name == "ladd" || name == "radd" || name == "with"))
+        vars_read.insert(args[1]);
+
+    // alias prints instead of defining one when it's given fewer arguments
+    if (is_builtin && name == "alias" && argc >= 3)
+        return;
+
+    if (is_builtin ? !replayable_builtins.count(name) : !captured)
+        line_rerun = true;
+}
+
+// Saves a snapshot if everything the rc file did can be replayed
+void end_snapshot() {
+    if (!recording)
+        return;
+
+    recording = false;
+
+    if (!replayable)
+        return;
+
+    std::map<string, string> env_after = current_env();
+    std::vector<std::pair<string, string>> sets;
+    std::vector<string> unsets;
+
+    for (const auto &[name, value] : env_after) {
+        auto before = env_before.find(name);
+
+        if (before == env_before.end() || before->second != value)
+            sets.emplace_back(name, value);
+    }
+
+    for (const auto &[name, value] : env_before) {
+        if (!env_after.count(name))
+            unsets.push_back(name);
+    }
+
+    string buf(snapshot_magic, sizeof(snapshot_magic));
+    put<uint64_t>(buf, recording_key);
+
+    // What the variables were before the rc file touched them
+    put<uint32_t>(buf, vars_read.size());
+    for (const string &name : vars_read) {
+        auto before = env_before.find(name);
+
+        put(buf, name);
+        put<uint64_t>(buf, var_hash(before == env_before.end() ? nullptr : before->second.c_str()));
+    }
+
+    put<uint32_t>(buf, probes.size());
+    for (const Probe &probe : probes) {
+        put<uint32_t>(buf, probe.args.size());
+
+        for (const string &arg : probe.args)
+            put(buf, arg);
+
+        put<int32_t>(buf, probe.status);
+    }
+
+    put<uint32_t>(buf, sets.size());
+    for (const auto &[name, value] : sets) {
+        put(buf, name);
+        put(buf, value);
+    }
+
+    put<uint32_t>(buf, unsets.size());
+    for (const string &name : unsets)
+        put(buf, name);
+
+    put<uint32_t>(buf, alias_map.size());
+    for (const auto &[name, value] : alias_map) {
+        put(buf, name);
+        put(buf, value);
+    }
+
+    std::vector<PathListing> listings = path_listings();
+
+    put<uint32_t>(buf, listings.size());
+    for (const PathListing &listing : listings) {
+        put(buf, listing.dir);
+        put<int64_t>(buf, modified_time(listing.dir));
+        put<uint32_t>(buf, listing.names.size());
+
+        for (const string &name : listing.names)
+            put(buf, name);
+    }
+
+    put<uint32_t>(buf, rerun_lines.size());
+    for (const string &line : rerun_lines)
+        put(buf, line);
+
+    env_before.clear();
+    vars_read.clear();
+    probes.clear();
+    rerun_lines.clear();
+
+    // Write it somewhere else first so that no other shell ever maps half a snapshot
+    string path = snapshot_path();
+    string tmp_path = path + "." + std::to_string(getpid());
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+    if (fd == -1)
+        return;
+
+    const char *p = buf.data();
+    size_t left = buf.length();
+
+    while (left > 0) {
+        ssize_t nwritten = write(fd, p, left);
+
+        if (nwritten <= 0)
+            break;
+
+        p += nwritten;
+        left -= nwritten;
+    }
+
+    close(fd);
+
+    if (left == 0 && rename(tmp_path.c_str(), path.c_str()) == 0)
+        return;
+
+    unlink(tmp_path.c_str());
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+bool load_snapshot(const std::string&, std::vector<std::string>&);
+void begin_snapshot(const std::string&);
+void observe_line_start();
+void observe_line_end(const std::string&);
+void observe_var(const std::string&);
+void observe_command(int, char**, bool, bool);
+void end_snapshot();
@@ -0,0 +1,78 @@
+#include "../complete.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using std::string;
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        std::fprintf(stderr, "FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+// Completes until the whole listing has arrived
+static std::vector<string> complete_all(const string &path) {
+    bool partial = true;
+    std::vector<string> found;
+
+    for (int tries = 0; partial && tries < 1000; ++tries) {
+        found = complete_path(path, &partial);
+
+        if (partial)
+            usleep(1000);
+    }
+
+    return found;
+}
+
+static string make_dir(const string &root, const string &name, const string &file) {
+    string dir = root + "/" + name;
+    mkdir(dir.c_str(), 0700);
+    close(open((dir + "/" + file).c_str(), O_WRONLY | O_CREAT, 0600));
+    return dir;
+}
+
+// Two directories with the same modification time mustn't share a listing
+static void test_equal_mtimes() {
+    char root_template[] = "/tmp/wsh_complete_XXXXXX";
+    string root = mkdtemp(root_template);
+    string a = make_dir(root, "a", "from_a");
+    string b = make_dir(root, "b", "from_b");
+
+    struct timespec times[2] = { { 1000000000, 0 }, { 1000000000, 0 } };
+    utimensat(AT_FDCWD, a.c_str(), times, 0);
+    utimensat(AT_FDCWD, b.c_str(), times, 0);
+
+    chdir(a.c_str());
+    std::vector<string> in_a = complete_all("from");
+    check(in_a.size() == 1 && in_a[0] == "./from_a", "listing of the first directory");
+
+    chdir(b.c_str());
+    std::vector<string> in_b = complete_all("from");
+    check(in_b.size() == 1 && in_b[0] == "./from_b", "listing after cd to a directory with the same mtime");
+
+    chdir("/");
+    unlink((a + "/from_a").c_str());
+    unlink((b + "/from_b").c_str());
+    rmdir(a.c_str());
+    rmdir(b.c_str());
+    rmdir(root.c_str());
+}
+
+int main() {
+    test_equal_mtimes();
+
+    if (failures == 0)
+        std::printf("All tests passed\n");
+
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
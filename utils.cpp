@@ -1,70 +1,32 @@
 #include "config.h"
 #include "control.h"
+#include "fuzzy.h"
 #include "global.h"
+#include "input.h"
+#include "jobs.h"
+#include "snapshot.h"
 #include "utils.h"
 
+#include <algorithm>
+#include <array>
 #include <cstdio>
+#include <cstdlib>
+#include <ctime>
 #include <filesystem>
+#include <iterator>
 #include <limits.h>
 #include <map>
 #include <pwd.h>
 #include <regex>
 #include <string>
 #include <sys/stat.h>
-#include <termios.h>
 #include <unistd.h>
 #include <vector>
 
 using std::string;
 
-static struct termios old, current;
 static const struct Command empty_command;
 
-// Initialize new terminal i/o settings
-void init_termios() {
-    tcgetattr(0, &old); // grab old terminal i/o settings
-    current = old; // make new settings same as old settings
-    current.c_lflag &= ~ICANON; // disable buffered i/o
-    current.c_lflag &= ~ECHO; // set no echo mode
-    tcsetattr(0, TCSANOW, &current); // use these new terminal i/o settings now
-}
-
-// Restore old terminal i/o settings
-void reset_termios() {
-    tcsetattr(0, TCSANOW, &old);
-}
-
-// Read a character, non-buffered
-char getch() {
-    char ch;
-    init_termios();
-    ch = getchar();
-    reset_termios();
-    return ch;
-}
-
-// Uses a DSR escape to retrieve cursor row and column
-// Beware: The row and column are 1-indexed!
-void get_cursor_pos(int *row, int *col) {
-    string row_str;
-    string col_str;
-    char ch;
-
-    std::cout << "\e[6n";
-
-    getch(); // ESC
-    getch(); // [
-
-    while ((ch = getch()) != ';')
-        row_str += ch;
-
-    while ((ch = getch()) != 'R')
-        col_str += ch;
-
-    *row = std::stoi(row_str);
-    *col = std::stoi(col_str);
-}
-
 void trim(string &s) {
     s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](unsigned char ch) {
         return !std::isspace(ch);
@@ -90,125 +52,392 @@ bool any_exists(const string& name) {
     return stat(name.c_str(), &buffer) == 0;
 }
 
-std::vector<string> filter_prefix(const std::map<string, string>& map, const string& search_for) {
+// Nanoseconds since the epoch that a file was last modified, or -1 if it doesn't exist
+int64_t modified_time(const string& name) {
+    struct stat buffer;
+
+    if (stat(name.c_str(), &buffer) != 0)
+        return -1;
+
+#ifdef __APPLE__
+    return (int64_t) buffer.st_mtimespec.tv_sec * 1000000000 + buffer.st_mtimespec.tv_nsec;
+#else
+    return (int64_t) buffer.st_mtim.tv_sec * 1000000000 + buffer.st_mtim.tv_nsec;
+#endif
+}
+
+// The maps are already sorted, so everything starting with search_for sits in one
+// contiguous run beginning at lower_bound: O(log n + k) instead of a full walk
+template <typename Map>
+static void collect_prefix(const Map& map, const string& search_for, std::vector<string>& output) {
+    for (auto it = map.lower_bound(search_for); it != map.end(); ++it) {
+        if (it->first.compare(0, search_for.length(), search_for) != 0)
+            break;
+
+        output.push_back(it->first);
+    }
+}
+
+template <typename Map>
+static void collect_fuzzy(const Map& map, const FuzzyPattern& pattern, std::vector<FuzzyMatch>& output) {
+    int score;
+
+    for (const auto& entry : map) {
+        if (fuzzy_match(pattern, entry.first, &score))
+            output.push_back({ score, entry.first });
+    }
+}
+
+// Every command name starting with search_for, whether it's an executable, a builtin
+// or an alias, in order. Only when nothing starts with it do we walk the maps for
+// fuzzy matches, best first. These read straight from the maps, so they never go
+// stale as the maps change.
+std::vector<string> command_completions(const string& search_for) {
     std::vector<string> output;
 
-    auto it = map.begin();
-    while (it != map.end()) {
-        string name = it->first;
-        if (name.rfind(search_for, 0) == 0)
-            output.push_back(name);
-        ++it;
+    collect_prefix(executable_map, search_for, output);
+    collect_prefix(builtins_map, search_for, output);
+    collect_prefix(alias_map, search_for, output);
+
+    if (!output.empty()) {
+        // A name can be in more than one of the maps
+        std::sort(output.begin(), output.end());
+        output.erase(std::unique(output.begin(), output.end()), output.end());
+        return output;
     }
 
-    return output;
+    FuzzyPattern pattern = fuzzy_pattern(search_for);
+    std::vector<FuzzyMatch> found;
+
+    collect_fuzzy(executable_map, pattern, found);
+    collect_fuzzy(builtins_map, pattern, found);
+    collect_fuzzy(alias_map, pattern, found);
+
+    return rank_matches(found);
 }
 
-string escape_string(string str) {
-    string output = str;
+// Values that can't change over the life of the shell, looked up on first use
+struct SessionInfo {
+    bool loaded = false;
+    bool root = false;
+    string home;
+    string hostname;
+    string login;
+    string tty;
+};
 
-    std::regex escapes("\\\\([\\\\\"'\\{\\}\\$adehHjlnrstT@uvVwW])");
-    string::const_iterator search_start(str.cbegin());
-    std::smatch match;
-    int offset = 0;
-
-    while (regex_search(search_start, str.cend(), match, escapes)) {
-        std::string replacement;
-
-        if (match[1] == "\\" || match[1] == "\"" || match[1] == "\'" || match[1] == "{" || match[1] == "}") {
-            // Replacement of literal backslashes, quotes, and brackets
-            replacement = match[1];
-        } else if (match[1] == "n") {
-            replacement = "\n";
-        } else if (match[1] == "r") {
-            replacement = "\r";
-        } else if (match[1] == "e") {
-            replacement = "\e";
-        } else if (match[1] == "a") {
-            replacement = "\x07";
-        } else if (match[1] == "h" || match[1] == "H") {
-            char *name = (char*) malloc(_POSIX_HOST_NAME_MAX * sizeof(char));
-            gethostname(name, _POSIX_HOST_NAME_MAX);
-            replacement = string(name);
-        } else if (match[1] == "u") {
-            replacement = getlogin() ?: "";
-        } else if (match[1] == "s" ) {
-            replacement = SHELL_NAME;
-        } else if (match[1] == "w") {
-            replacement = std::filesystem::current_path();
-        } else if (match[1] == "W") {
-            replacement = std::filesystem::current_path().stem();
-        } else if (match[1] == "$") {
-            replacement = geteuid() == 0 ? "#" : "$";
-        } else if (match[1] == "t") {
-            std::time_t t = std::time(0);
-            std::ostringstream os;
-            os << std::put_time(std::localtime(&t), "%H:%M:%S");
-            replacement = os.str();
-        } else if (match[1] == "T") {
-            std::time_t t = std::time(0);
-            std::ostringstream os;
-            os << std::put_time(std::localtime(&t), "%I:%M:%S");
-            replacement = os.str();
-        } else if (match[1] == "@") {
-            std::time_t t = std::time(0);
-            std::ostringstream os;
-            os << std::put_time(std::localtime(&t), "%I:%M:%S %p");
-            replacement = os.str();
-        } else if (match[1] == "d") {
+static SessionInfo session;
+
+static const SessionInfo& session_info() {
+    if (session.loaded)
+        return session;
+
+    struct passwd *pw = getpwuid(getuid());
+    char hostname[_POSIX_HOST_NAME_MAX + 1] = {};
+    const char *tty = ttyname(STDIN_FILENO);
+
+    gethostname(hostname, _POSIX_HOST_NAME_MAX);
+
+    session.root = geteuid() == 0;
+    session.home = pw ? pw->pw_dir : (std::getenv("HOME") ?: "");
+    session.hostname = hostname;
+    session.login = getlogin() ?: (pw ? pw->pw_name : "");
+    session.tty = tty ? std::filesystem::path(tty).filename().string() : "";
+    session.loaded = true;
+
+    return session;
+}
+
+const string& home_dir() {
+    return session_info().home;
+}
+
+// The working directory only changes when the shell runs cd, which invalidates this
+static string cwd;
+static unsigned int cwd_generation = 1;
+static unsigned int cwd_loaded = 0;
+
+const string& current_dir() {
+    if (cwd_loaded != cwd_generation) {
+        cwd = std::filesystem::current_path().string();
+        cwd_loaded = cwd_generation;
+    }
+
+    return cwd;
+}
+
+void invalidate_current_dir() {
+    ++cwd_generation;
+}
+
+enum EscapeKind : uint8_t {
+    ESC_NONE,    // Not an escape, the backslash is kept
+    ESC_CHAR,    // Replaced by a single character
+    ESC_HOST,
+    ESC_JOBS,
+    ESC_TTY,
+    ESC_LOGIN,
+    ESC_SHELL,
+    ESC_CWD,
+    ESC_CWD_BASE,
+    ESC_PROMPT,
+    ESC_TIME,    // Formatted with strftime
+    ESC_VERSION,
+    ESC_VERSION_FULL,
+};
+
+struct Escape {
+    EscapeKind kind = ESC_NONE;
+    char ch = '\0';
+    const char *format = nullptr;
+};
+
+static constexpr std::array<Escape, 128> make_escapes() {
+    std::array<Escape, 128> table {};
+
+    // Literal backslashes, quotes, and brackets
+    for (char ch : { '\\', '\"', '\'', '{', '}' })
+        table[ch] = { ESC_CHAR, ch };
+
+    table['n'] = { ESC_CHAR, '\n' };
+    table['r'] = { ESC_CHAR, '\r' };
+    table['e'] = { ESC_CHAR, '\e' };
+    table['a'] = { ESC_CHAR, '\x07' };
+    table['h'] = { ESC_HOST };
+    table['H'] = { ESC_HOST };
+    table['j'] = { ESC_JOBS };
+    table['l'] = { ESC_TTY };
+    table['u'] = { ESC_LOGIN };
+    table['s'] = { ESC_SHELL };
+    table['w'] = { ESC_CWD };
+    table['W'] = { ESC_CWD_BASE };
+    table['$'] = { ESC_PROMPT };
+    table['t'] = { ESC_TIME, '\0', "%H:%M:%S" };
+    table['T'] = { ESC_TIME, '\0', "%I:%M:%S" };
+    table['@'] = { ESC_TIME, '\0', "%I:%M:%S %p" };
+    table['d'] = { ESC_TIME, '\0', "%a %b %d" };
+    table['v'] = { ESC_VERSION };
+    table['V'] = { ESC_VERSION_FULL };
+
+    return table;
+}
+
+static constexpr std::array<Escape, 128> escapes = make_escapes();
+
+static inline bool is_word(char ch) {
+    return std::isalnum((unsigned char) ch) || ch == '_';
+}
+
+static void append_escape(string &output, const Escape &escape) {
+    switch (escape.kind) {
+        case ESC_NONE:
+            break;
+        case ESC_CHAR:
+            output += escape.ch;
+            break;
+        case ESC_HOST:
+            output += session_info().hostname;
+            break;
+        case ESC_JOBS:
+            output += std::to_string(job_count());
+            break;
+        case ESC_TTY:
+            output += session_info().tty;
+            break;
+        case ESC_LOGIN:
+            output += session_info().login;
+            break;
+        case ESC_SHELL:
+            output += SHELL_NAME;
+            break;
+        case ESC_CWD:
+            output += current_dir();
+            break;
+        case ESC_CWD_BASE:
+            output += std::filesystem::path(current_dir()).stem().string();
+            break;
+        case ESC_PROMPT:
+            output += session_info().root ? '#' : '$';
+            break;
+        case ESC_TIME: {
+            char buf[64];
+            struct tm now;
             std::time_t t = std::time(0);
-            std::ostringstream os;
-            os << std::put_time(std::localtime(&t), "%a %b %d");
-            replacement = os.str();
-        } else if (match[1] == "v") {
-            std::ostringstream os;
-            os << VERSION_MAJOR << "." << VERSION_MINOR;
-            replacement = os.str();
-        } else if (match[1] == "V") {
-            std::ostringstream os;
-            os << VERSION_MAJOR << "." << VERSION_MINOR << "." << VERSION_PATCH;
-            replacement = os.str();
+            localtime_r(&t, &now);
+            output.append(buf, strftime(buf, sizeof(buf), escape.format, &now));
+            break;
         }
+        case ESC_VERSION:
+            output += std::to_string(VERSION_MAJOR) + "." + std::to_string(VERSION_MINOR);
+            break;
+        case ESC_VERSION_FULL:
+            output += std::to_string(VERSION_MAJOR) + "." + std::to_string(VERSION_MINOR) + "." + std::to_string(VERSION_PATCH);
+            break;
+    }
+}
 
-        output.replace(match.position() + offset, match.length(), replacement);
-        offset += match.position() + replacement.length();
-        search_start = match.suffix().first;
+// Expands {VAR}, ~, and backslash escapes (selected by the EXPAND_* flags) in a
+// single left-to-right scan. Substituted values are inserted as-is and are never
+// scanned again.
+string expand_string(const string &input, unsigned int what) {
+    string output;
+    output.reserve(input.length());
+
+    const char *p = input.data();
+    const char *end = p + input.length();
+
+    while (p < end) {
+        char ch = *p;
+
+        if (ch == '\\' && p + 1 < end) {
+            char next = p[1];
+
+            if (what & EXPAND_ESCAPES) {
+                if ((unsigned char) next < escapes.size() && escapes[next].kind != ESC_NONE) {
+                    append_escape(output, escapes[next]);
+                    p += 2;
+                    continue;
+                }
+            } else if (next == '\\' || next == '{') {
+                // An escaped bracket is never a variable, and a pair of backslashes never escapes one
+                output += ch;
+                output += next;
+                p += 2;
+                continue;
+            }
+        } else if (ch == '{' && (what & EXPAND_VARIABLES)) {
+            const char *name_end = p + 1;
+
+            while (name_end < end && is_word(*name_end))
+                ++name_end;
+
+            if (name_end > p + 1 && name_end < end && *name_end == '}') {
+                string name(p + 1, name_end);
+                observe_var(name);
+                const char *c_var = std::getenv(name.c_str());
+
+                if (c_var)
+                    output += c_var;
+
+                p = name_end + 1;
+                continue;
+            }
+        } else if (ch == '~' && (what & EXPAND_TILDES)) {
+            output += home_dir();
+            ++p;
+            continue;
+        }
+
+        output += ch;
+        ++p;
     }
 
     return output;
 }
 
-string replace_variables(string &input) {
-    string output(input);
-    int offset = 0;
+string escape_string(const string &str) {
+    return expand_string(str, EXPAND_ESCAPES);
+}
 
-    // Replace with environment variables
-    std::smatch match;
-    std::regex variable("(?:^|[^\\\\])(?:\\\\\\\\)*\\{(\\w+)\\}");
-    string::const_iterator search_start(input.cbegin());
+string replace_variables(const string &input) {
+    return expand_string(input, EXPAND_VARIABLES | EXPAND_TILDES);
+}
 
-    while (regex_search(search_start, input.cend(), match, variable)) {
-        const char* c_var = std::getenv(match[1].str().c_str());
-        string var(c_var ?: "");
-        output.replace(match.position(1) - 1 + offset, match.length(1) + 2, var);
-        offset += match.position(1) - 1 + var.length();
-        search_start = match.suffix().first;
+// A prompt is compiled into literal text and the few escapes that can change
+// between prompts. Everything else is resolved once when it's compiled.
+struct PromptSegment {
+    Escape escape;
+    string text;
+    std::time_t stamp = 0;
+};
+
+static string prompt_source;
+static std::vector<PromptSegment> prompt_segments;
+static string prompt_output;
+static bool prompt_compiled = false;
+
+static inline bool is_dynamic(EscapeKind kind) {
+    return kind == ESC_CWD || kind == ESC_CWD_BASE || kind == ESC_TIME || kind == ESC_JOBS;
+}
+
+static void compile_prompt(const string &source) {
+    prompt_source = source;
+    prompt_segments.clear();
+    prompt_segments.emplace_back();
+
+    const char *p = source.data();
+    const char *end = p + source.length();
+
+    while (p < end) {
+        if (*p == '\\' && p + 1 < end && (unsigned char) p[1] < escapes.size() && escapes[p[1]].kind != ESC_NONE) {
+            const Escape &escape = escapes[p[1]];
+
+            if (is_dynamic(escape.kind)) {
+                prompt_segments.push_back({ escape });
+                prompt_segments.emplace_back();
+            } else {
+                append_escape(prompt_segments.back().text, escape);
+            }
+
+            p += 2;
+        } else {
+            prompt_segments.back().text += *p++;
+        }
     }
 
-    // Expand home directory
-    std::regex tilde("~");
-    search_start = input.cbegin();
-    struct passwd *pw = getpwuid(getuid());
-    string home(pw->pw_dir);
-    offset = 0;
+    prompt_compiled = true;
+}
 
-    while (regex_search(search_start, input.cend(), match, tilde)) {
-        output.replace(match.position() + offset, match.length(), home);
-        offset += match.position() + home.length();
-        search_start = match.suffix().first;
+// Returns the prompt for the given WSH_PROMPT, only recompiling it when it has changed
+// and only refreshing the working directory on cd and the time once a second
+const string& render_prompt(const string &source) {
+    bool recompiled = false;
+    bool changed = false;
+
+    if (!prompt_compiled || source != prompt_source) {
+        compile_prompt(source);
+        recompiled = true;
+        changed = true;
     }
 
-    return output;
+    std::time_t now = std::time(0);
+
+    for (PromptSegment &segment : prompt_segments) {
+        std::time_t stamp;
+
+        switch (segment.escape.kind) {
+            case ESC_CWD:
+            case ESC_CWD_BASE:
+                current_dir();
+                stamp = cwd_generation;
+                break;
+            case ESC_TIME:
+                stamp = now;
+                break;
+            case ESC_JOBS:
+                stamp = job_count();
+                break;
+            default:
+                continue;
+        }
+
+        if (segment.stamp == stamp && !recompiled)
+            continue;
+
+        segment.text.clear();
+        append_escape(segment.text, segment.escape);
+        segment.stamp = stamp;
+        changed = true;
+    }
+
+    if (changed) {
+        prompt_output.clear();
+
+        for (const PromptSegment &segment : prompt_segments)
+            prompt_output += segment.text;
+    }
+
+    return prompt_output;
 }
 
 std::vector<string> expand_brackets(string input) {
@@ -278,213 +507,176 @@ void print_commands(std::vector<Command> commands) {
     }
 }
 
-Argument tokenize_arg(string input) {
-    bool inside_squotes = false;
-    bool inside_dquotes = false;
-    bool inside_backticks = false;
-    bool escaping = false;
-    char ch;
-    Argument arg;
-
-    string raw_str;
-
-    for (int i = 0; i < input.size(); ++i) {
-        ch = input[i];
-
-        if (escaping) {
-            escaping = false;
-            raw_str += ch;
-        } else if (inside_squotes) {
-            if (ch == '\'') {
-                raw_str += ch;
-                arg.push_back(raw_str);
-                raw_str = "";
-                inside_squotes = false;
-            } else if (ch == '\\') {
-                escaping = true;
-                raw_str += ch;
-            } else {
-                raw_str += ch;
-            }
-        } else if (inside_dquotes) {
-            if (ch == '\"') {
-                raw_str += ch;
-                arg.push_back(raw_str);
-                raw_str = "";
-                inside_dquotes = false;
-            } else if (ch == '\\') {
-                escaping = true;
-                raw_str += ch;
-            } else {
-                raw_str += ch;
-            }
-        } else if (inside_backticks) {
-            if (ch == '`') {
-                arg.push_back(tokenize(raw_str));
-                raw_str = "";
-                inside_backticks = false;
-            } else if (ch == '\\') {
-                escaping = true;
-                raw_str += ch;
-            } else {
-                raw_str += ch;
-            }
-        } else {
-            if (ch == '\'') {
-                if (!raw_str.empty()) {
-                    arg.push_back(raw_str);
-                    raw_str = "";
-                }
-                raw_str += ch;
-                inside_squotes = true;
-            } else if (ch == '\"') {
-                if (!raw_str.empty()) {
-                    arg.push_back(raw_str);
-                    raw_str = "";
-                }
-                raw_str += ch;
-                inside_dquotes = true;
-            } else if (ch == '`') {
-                if (!raw_str.empty()) {
-                    arg.push_back(raw_str);
-                    raw_str = "";
-                }
-                inside_backticks = true;
-            } else {
-                raw_str += ch;
-            }
-        }
-    }
-
-    if (!raw_str.empty())
-        arg.push_back(raw_str);
-
-    return arg;
+static inline bool is_blank(char ch) {
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\v' || ch == '\f' || ch == '\r';
 }
 
-void quotes_mask(string input, bool *inside_quotes) {
-    bool inside_squotes = false;
-    bool inside_dquotes = false;
-    bool inside_backticks = false;
-    bool escaping = false;
+// Adds each whitespace separated word in text to words
+void split_words(std::string_view text, std::vector<string> &words) {
+    const char *p = text.data();
+    const char *end = p + text.length();
 
-    inside_quotes[input.length()] = false;
+    while (p < end) {
+        while (p < end && is_blank(*p))
+            ++p;
 
-    for (int i = 0; i < input.size(); ++i) {
-        inside_quotes[i] = inside_squotes || inside_dquotes || inside_backticks;
+        const char *start = p;
 
-        if (escaping) {
-            escaping = false;
-        } else if (inside_squotes) {
-            if (input[i] == '\'')
-                inside_squotes = false;
-            else if (input[i] == '\\')
-                escaping = true;
-        } else if (inside_dquotes) {
-            if (input[i] == '\"')
-                inside_dquotes = false;
-            else if (input[i] == '\\')
-                escaping = true;
-        } else if (inside_backticks) {
-            if (input[i] == '`')
-                inside_backticks = false;
-            else if (input[i] == '\\')
-                escaping = true;
-        } else {
-            if (input[i] == '\'')
-                inside_squotes = true;
-            else if (input[i] == '\"')
-                inside_dquotes = true;
-            else if (input[i] == '`')
-                inside_backticks = true;
-        }
+        while (p < end && !is_blank(*p))
+            ++p;
+
+        if (p > start)
+            words.emplace_back(start, p - start);
     }
 }
 
-std::vector<Command> tokenize(string input) {
-    int offset = 0;
-    int pos = 0;
-    int last = 0;
-    std::vector<Command> commands;
-    string token;
-    std::smatch match;
+static inline bool is_operator(char ch) {
+    return ch == ';' || ch == '|' || ch == '&';
+}
 
-    bool inside_quotes[input.length() + 1];
-    quotes_mask(input, inside_quotes);
+// Splits a line into commands in a single pass. Outside of quotes and backticks,
+// a run of whitespace separates arguments, and a run of whitespace containing one
+// of ; | || && & separates commands. Quoted strings are kept with their quotes so
+// that cmd_launch can decide how to expand them, and backtick bodies are tokenized
+// into their own CommandList.
+std::vector<Command> tokenize(const string &input) {
+    enum { NONE, SQUOTES, DQUOTES, BACKTICKS } state = NONE;
+    bool escaping = false;
+    bool has_token = false;
 
+    std::vector<Command> commands;
     struct Command cmd = empty_command;
-    std::vector<Argument> args;
-    std::regex token_separator("((?:\\s*(?:;|\\|\\||\\||&&|&)\\s*)|\\s+)");
-    input += ';';
-    string::const_iterator search_start(input.cbegin());
-    string text;
-    string separator;
-
-    while (regex_search(search_start, input.cend(), match, token_separator)) {
-        search_start = match.suffix().first;
-        pos = match.position() + offset;
-        offset += match.position() + match.length();
+    Argument arg;
+    string raw_str;
 
-        if (inside_quotes[pos])
-            continue;
+    const char *p = input.data();
+    const char *end = p + input.length();
 
-        text = input.substr(last, pos - last);
-        separator = match[1];
-        trim(separator);
-        last = pos + match.length();
+    // Ends the current argument, and the current command too if there's an operator
+    auto separate = [&](const char *op, size_t op_len) {
+        // Separators with nothing before them are simply dropped
+        if (!has_token)
+            return;
 
-        if (text.empty())
-            continue;
+        if (!raw_str.empty()) {
+            arg.push_back(raw_str);
+            raw_str.clear();
+        }
 
-        args.push_back(tokenize_arg(text));
+        cmd.args.push_back(std::move(arg));
+        arg.clear();
+        has_token = false;
 
         // Only a whitespace separator, our command isn't done yet
-        if (separator.empty())
-            continue;
+        if (op_len == 0)
+            return;
 
-        if (separator == "||") {
+        if (op_len == 2 && op[0] == '|') {
             // Conditional OR separator
             cmd.or_output = true;
-        } else if (separator == "|") {
+        } else if (op[0] == '|') {
             // Pipe output
             cmd.pipe_output = true;
-        } else if (separator == "&&") {
+        } else if (op_len == 2 && op[0] == '&') {
             // Conditional AND separator
             cmd.and_output = true;
-        } else if (separator == "&") {
+        } else if (op[0] == '&') {
             // Send to background
             cmd.bg_command = true;
         }
 
-        cmd.args = args;
-        commands.push_back(cmd);
+        commands.push_back(std::move(cmd));
         cmd = empty_command;
-        args.clear();
-    }
+    };
 
-    return commands;
-}
+    while (p < end) {
+        char ch = *p;
+
+        if (escaping) {
+            escaping = false;
+            raw_str += ch;
+            ++p;
+            continue;
+        }
 
-std::vector<string> complete_path(string path) {
-    auto idx = path.find_last_of('/');
-    string head;
-    std::vector<string> paths;
+        switch (state) {
+            case SQUOTES:
+            case DQUOTES:
+                raw_str += ch;
 
-    if (idx != std::string::npos) {
-        head = path.substr(0, idx);
-    } else {
-        head = "./";
-        path = head + path;
-    }
+                if (ch == '\\') {
+                    escaping = true;
+                } else if (ch == (state == SQUOTES ? '\'' : '\"')) {
+                    arg.push_back(raw_str);
+                    raw_str.clear();
+                    state = NONE;
+                }
+
+                ++p;
+                continue;
+            case BACKTICKS:
+                if (ch == '`') {
+                    arg.push_back(tokenize(raw_str));
+                    raw_str.clear();
+                    state = NONE;
+                } else {
+                    escaping = ch == '\\';
+                    raw_str += ch;
+                }
 
-    for (const auto & entry : std::filesystem::directory_iterator(head)) {
-        string option = entry.path().string();
-        if (option.rfind(path, 0) == 0) {
-            paths.push_back(option);
+                ++p;
+                continue;
+            case NONE:
+                break;
         }
+
+        if (is_blank(ch) || is_operator(ch)) {
+            const char *op = nullptr;
+            size_t op_len = 0;
+
+            while (p < end && is_blank(*p))
+                ++p;
+
+            if (p == end) {
+                // The end of the line acts as a trailing ;
+                op = ";";
+                op_len = 1;
+            } else if (is_operator(*p)) {
+                op = p;
+                op_len = (p + 1 < end && *p != ';' && p[1] == *p) ? 2 : 1;
+                p += op_len;
+
+                while (p < end && is_blank(*p))
+                    ++p;
+            }
+
+            separate(op, op_len);
+            continue;
+        }
+
+        has_token = true;
+
+        if (ch == '\'' || ch == '\"' || ch == '`') {
+            if (!raw_str.empty()) {
+                arg.push_back(raw_str);
+                raw_str.clear();
+            }
+
+            if (ch != '`')
+                raw_str += ch;
+
+            state = ch == '\'' ? SQUOTES : ch == '\"' ? DQUOTES : BACKTICKS;
+        } else {
+            raw_str += ch;
+        }
+
+        ++p;
     }
 
-    return paths;
+    // An unterminated quote simply runs to the end of the line
+    separate(";", 1);
+
+    return commands;
 }
 
 std::ostream& operator<<(std::ostream& out, utf8c ch) {
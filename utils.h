@@ -1,8 +1,10 @@
 #pragma once
 
+#include <cstdint>
 #include <iostream>
 #include <map>
 #include <string>
+#include <string_view>
 #include <variant>
 #include <vector>
 
@@ -26,21 +28,25 @@ using CommandList = recursive_wrapper<std::vector<Command>>;
 using Value = std::variant<std::monostate, std::string, CommandList>;
 using Argument = std::vector<Value>;
 
-char getch(void);
 void trim(std::string&);
 bool dir_exists(const std::string&);
 bool file_exists(const std::string&);
 bool any_exists(const std::string&);
-std::vector<std::string> filter_prefix(const std::map<std::string, std::string>&, const std::string&);
+int64_t modified_time(const std::string&);
+std::vector<std::string> command_completions(const std::string&);
 int token_separator(std::string);
-std::vector<Command> tokenize(std::string);
-std::string escape_string(std::string);
-std::string replace_variables(std::string&);
+std::vector<Command> tokenize(const std::string&);
+void split_words(std::string_view, std::vector<std::string>&);
+const std::string& home_dir();
+const std::string& current_dir();
+void invalidate_current_dir();
+std::string expand_string(const std::string&, unsigned int);
+std::string escape_string(const std::string&);
+std::string replace_variables(const std::string&);
+const std::string& render_prompt(const std::string&);
 std::vector<std::string> expand_brackets(std::string);
 std::vector<Argument> expand_argument(Argument);
 void print_commands(std::vector<Command> commands);
-std::vector<std::string> complete_path(std::string path);
-void get_cursor_pos(int*, int*);
 utf8c getuch();
 
 std::ostream& operator<<(std::ostream& out, utf8c ch);